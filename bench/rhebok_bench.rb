@@ -0,0 +1,250 @@
+require 'socket'
+require 'stringio'
+require 'json'
+require 'rack'
+require 'rack/handler/rhebok'
+
+# benchmarks of native hot paths and end-to-end load scenarios.
+# results are compared with a baseline saved by `rake bench:save`
+module RhebokBench
+  CORPUS = File.expand_path('../corpus', __FILE__)
+  # seconds each microbenchmark runs
+  MICRO_TIME = (ENV['BENCH_TIME'] || 1).to_f
+  # multiplier of requests in load scenarios
+  SCALE = (ENV['BENCH_SCALE'] || 1).to_f
+  # percent of change reported as regression
+  THRESHOLD = (ENV['BENCH_THRESHOLD'] || 10).to_f
+
+  ENV_TEMPLATE = {
+    "SERVER_NAME"       => "127.0.0.1",
+    "SERVER_PORT"       => "0",
+    "rack.version"      => [1,1],
+    "rack.errors"       => STDERR,
+    "rack.multithread"  => false,
+    "rack.multiprocess" => true,
+    "rack.run_once"     => false,
+    "rack.url_scheme"   => "http",
+    "rack.input"        => StringIO.new(""),
+  }.freeze
+
+  RESPONSES = {
+    "tiny" => [200, {"Content-Type" => "text/plain"}, ["Hello World"]],
+    "html" => [200, {
+      "Content-Type" => "text/html; charset=utf-8",
+      "Content-Length" => "16384",
+      "Cache-Control" => "max-age=0, private, must-revalidate",
+      "ETag" => "W/\"5d41402abc4b2a76b9719d911017c592\"",
+      "Set-Cookie" => "_session_id=9f8a7b6c5d4e3f2a1b0c9d8e7f6a5b4c; path=/; HttpOnly\n_ga=GA1.2.1234567890; path=/; max-age=63072000",
+      "X-Frame-Options" => "SAMEORIGIN",
+      "X-Content-Type-Options" => "nosniff",
+      "X-Request-Id" => "2f1e0d3c-4b5a-6978-8a9b-0c1d2e3f4a5b",
+      "X-Runtime" => "0.012345",
+    }, ["x" * 16384]],
+    "array" => [200, {"Content-Type" => "application/json"}, Array.new(256) { "{\"id\":12345,\"name\":\"item\"}," * 40 }],
+  }
+
+  def self.requests
+    Dir.glob("#{CORPUS}/*.http").sort.map { |f|
+      [File.basename(f, ".http"), File.read(f).gsub(/\r?\n/, "\r\n")]
+    }
+  end
+
+  def self.chunked_body(size, chunk)
+    body = ""
+    (size / chunk).times { body << chunk.to_s(16) << "\r\n" << ("x" * chunk) << "\r\n" }
+    body << "0\r\n\r\n"
+  end
+
+  def self.percentile(sorted, p)
+    return 0 if sorted.empty?
+    sorted[[(sorted.size * p).floor, sorted.size - 1].min]
+  end
+
+  # runs the block in batches for MICRO_TIME. latency is per operation in a batch
+  def self.measure(batch)
+    samples = []
+    ops = 0
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    while true
+      t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      batch.times { yield }
+      t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      samples << (t1 - t0) / batch
+      ops += batch
+      break if t1 - started >= MICRO_TIME
+    end
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    samples.sort!
+    {"ops" => ops / elapsed, "p50" => percentile(samples, 0.5), "p99" => percentile(samples, 0.99)}
+  end
+
+  def self.micro
+    results = {}
+    sock, peer = UNIXSocket.pair
+    devnull = File.open(File::NULL, "w")
+    ::Rhebok.max_header_size = 16384
+
+    # _parse_http_request, path_info_value and find_common_header. buffered
+    # requests are parsed without reading the socket
+    requests.each do |name, req|
+      header = name == "post_chunked" ? req : req.split("\r\n\r\n", 2).first + "\r\n\r\n"
+      if ::Rhebok.read_rack(sock.fileno, header, 1, 1, ENV_TEMPLATE, "127.0.0.1", "0") == nil
+        raise "failed to parse #{name}"
+      end
+      results["micro/parse_#{name}"] = measure(100) {
+        ::Rhebok.read_rack(sock.fileno, header, 1, 1, ENV_TEMPLATE, "127.0.0.1", "0")
+      }
+    end
+
+    # chunked decoder
+    [[65536, 8192], [65536, 64]].each do |size, chunk|
+      body = chunked_body(size, chunk)
+      results["micro/read_chunked_#{chunk}"] = measure(10) {
+        ::Rhebok.read_chunked(sock.fileno, body, StringIO.new, 0, 1)
+      }
+    end
+
+    # response serializer and chunked encoder, written to /dev/null
+    RESPONSES.each do |name, (status, headers, body)|
+      results["micro/write_response_#{name}"] = measure(100) {
+        ::Rhebok.write_response(devnull.fileno, 1, status, headers, body, 0, 0, 0)
+      }
+      results["micro/write_response_chunked_#{name}"] = measure(100) {
+        ::Rhebok.write_response(devnull.fileno, 1, status, headers.reject { |k, v| k == "Content-Length" }, body, 1, 0, 0)
+      }
+    end
+    part = "x" * 4096
+    results["micro/write_chunk"] = measure(1000) {
+      ::Rhebok.write_chunk(devnull.fileno, part, 0, 1)
+    }
+    results
+  ensure
+    sock.close if sock
+    peer.close if peer
+    devnull.close if devnull
+  end
+
+  class StreamingBody
+    def each
+      64.times { yield "x" * 1024 }
+    end
+  end
+
+  APPS = {
+    "tiny" => proc { |env| [200, {"Content-Type" => "text/plain"}, ["Hello World"]] },
+    "array" => proc { |env| RESPONSES["array"] },
+    "streaming" => proc { |env| [200, {"Content-Type" => "text/plain"}, StreamingBody.new] },
+    "upload" => proc { |env| [200, {"Content-Type" => "text/plain"}, [env["rack.input"].read.bytesize.to_s]] },
+  }
+
+  def self.start_server(app, options)
+    pid = fork do
+      $stdout.reopen(File::NULL, "w")
+      Rack::Handler::Rhebok.run(app, options)
+      exit!(true)
+    end
+    100.times do
+      begin
+        (options[:Path] ? UNIXSocket.new(options[:Path]) : TCPSocket.new(options[:Host], options[:Port])).close
+        break
+      rescue SystemCallError
+        sleep 0.1
+      end
+    end
+    pid
+  end
+
+  def self.stop_server(pid)
+    Process.kill(:TERM, pid)
+    Process.wait(pid)
+  end
+
+  # read whole response of HTTP/1.0 request
+  def self.request(connect, req)
+    s = connect.call
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    s.write(req)
+    s.read
+    t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    s.close
+    t1 - t0
+  end
+
+  # clients run in processes, slow clients send a header byte every 10ms meanwhile
+  def self.load_scenario(app, options, req, clients: 4, requests: 500, slow: 0)
+    requests = (requests * SCALE).ceil
+    connect = options[:Path] ? proc { UNIXSocket.new(options[:Path]) } : proc { TCPSocket.new(options[:Host], options[:Port]) }
+    pid = start_server(app, options)
+    slow_pids = Array.new(slow) {
+      fork {
+        trap(:TERM) { exit!(true) }
+        loop {
+          s = connect.call
+          req.each_char { |c| s.write(c); sleep 0.01 }
+          s.read
+          s.close
+        }
+      }
+    }
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    readers = Array.new(clients) {
+      r, w = IO.pipe
+      client = fork {
+        r.close
+        latencies = Array.new(requests) { request(connect, req) }
+        w.write(Marshal.dump(latencies))
+        exit!(true)
+      }
+      w.close
+      [client, r]
+    }
+    latencies = readers.map { |client, r| Marshal.load(r.read).tap { Process.wait(client) } }.flatten.sort
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    {"rps" => latencies.size / elapsed, "p50" => percentile(latencies, 0.5), "p99" => percentile(latencies, 0.99)}
+  ensure
+    slow_pids.each { |p| Process.kill(:TERM, p) rescue nil; Process.wait(p) rescue nil } if slow_pids
+    stop_server(pid) if pid
+  end
+
+  def self.load
+    results = {}
+    port = (ENV['BENCH_PORT'] || 9393).to_i
+    sock_path = "/tmp/rhebok_bench_#{$$}.sock"
+    get = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n"
+    upload = "POST / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\nTransfer-Encoding: chunked\r\n\r\n" + chunked_body(65536, 4096)
+    tcp = {:Host => "127.0.0.1", :Port => port, :MaxWorkers => 4}
+    unix = {:Path => sock_path, :MaxWorkers => 4}
+
+    results["load/tcp_tiny"] = load_scenario(APPS["tiny"], tcp, get)
+    results["load/unix_tiny"] = load_scenario(APPS["tiny"], unix, get)
+    results["load/tcp_array"] = load_scenario(APPS["array"], tcp, get, requests: 200)
+    results["load/unix_array"] = load_scenario(APPS["array"], unix, get, requests: 200)
+    results["load/tcp_streaming"] = load_scenario(APPS["streaming"], tcp, get, requests: 200)
+    results["load/tcp_chunked_upload"] = load_scenario(APPS["upload"], tcp, upload, requests: 200)
+    results["load/tcp_slow_clients"] = load_scenario(APPS["tiny"], tcp, get, requests: 200, slow: 2)
+    results
+  ensure
+    File.unlink(sock_path) if sock_path && File.exist?(sock_path)
+  end
+
+  # throughput falling or latency rising more than THRESHOLD percent is a regression
+  def self.report(results, baseline)
+    regressions = []
+    puts "%-40s %6s %14s %14s %8s" % ["benchmark", "metric", "current", "baseline", "change"]
+    results.each do |name, metrics|
+      metrics.each do |metric, value|
+        base = baseline && baseline[name] && baseline[name][metric]
+        change = base && base > 0 ? (value - base) * 100.0 / base : nil
+        worse = change && (metric == "ops" || metric == "rps" ? -change : change) > THRESHOLD
+        regressions << "#{name} #{metric}" if worse
+        puts "%-40s %6s %14s %14s %8s%s" % [name, metric, format(metric, value), base ? format(metric, base) : "-",
+                                             change ? "%+.1f%%" % change : "-", worse ? " !!" : ""]
+      end
+    end
+    regressions
+  end
+
+  def self.format(metric, value)
+    metric == "ops" || metric == "rps" ? "%.1f/s" % value : "%.1fus" % (value * 1e6)
+  end
+end
@@ -0,0 +1,24 @@
+# usage: ruby -I./lib bench/run.rb [all|micro|load] [save]
+require File.expand_path('../rhebok_bench', __FILE__)
+
+mode = ARGV[0] || "all"
+baseline_path = ENV['BASELINE'] || File.expand_path('../baseline.json', __FILE__)
+
+results = {}
+results.merge!(RhebokBench.micro) if mode == "all" || mode == "micro"
+results.merge!(RhebokBench.load) if mode == "all" || mode == "load"
+
+if ARGV[1] == "save"
+  baseline = File.exist?(baseline_path) ? JSON.parse(File.read(baseline_path)) : {}
+  File.write(baseline_path, JSON.pretty_generate(baseline.merge(results)))
+  RhebokBench.report(results, nil)
+  puts "baseline saved to #{baseline_path}"
+  exit
+end
+
+baseline = File.exist?(baseline_path) ? JSON.parse(File.read(baseline_path)) : nil
+regressions = RhebokBench.report(results, baseline)
+if !regressions.empty?
+  puts "regressions over #{RhebokBench::THRESHOLD}%: #{regressions.join(", ")}"
+  exit 1
+end
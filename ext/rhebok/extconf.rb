@@ -1,2 +1,15 @@
 require "mkmf"
+have_header("sys/sendfile.h")
+have_header("sys/epoll.h")
+have_header("linux/io_uring.h")
+have_header("linux/mempolicy.h")
+have_header("linux/unix_diag.h")
+have_header("immintrin.h")
+have_func("sched_setaffinity", "sched.h")
+have_func("memfd_create", "sys/mman.h")
+have_func("fallocate", "fcntl.h")
+have_func("rb_interned_str", "ruby.h")
+have_func("rb_hash_new_capa", "ruby.h")
+have_func("rb_hash_bulk_insert", "ruby.h")
+have_header("ruby/fiber/scheduler.h")
 create_makefile("rhebok/rhebok")
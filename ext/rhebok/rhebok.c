@@ -1,4 +1,9 @@
 #include <ruby.h>
+#include <ruby/thread.h>
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#endif
 #include <time.h>
 #include <ctype.h>
 #include <poll.h>
@@ -11,10 +16,45 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+#define USE_IO_URING 1
+#endif
+#endif
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+#include <sys/stat.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#if defined(EPOLLEXCLUSIVE) && defined(SOCK_NONBLOCK)
+#define USE_EXCLUSIVE_ACCEPT 1
+#endif
+#endif
+#if defined(__x86_64__) && defined(HAVE_IMMINTRIN_H) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define USE_SIMD 1
+#endif
 #include "picohttpparser/picohttpparser.c"
 
 #ifndef IOV_MAX
@@ -30,10 +70,30 @@
 #define MAX_HEADER_SIZE 16384
 #define MAX_HEADER_NAME_LEN 1024
 #define MAX_HEADERS         128
+#define MAX_COMMON_HEADERS  64
+#define MAX_COMMON_HEADER_NAME_LEN 32
 #define BAD_REQUEST "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n400 Bad Request\r\n"
 #define EXPECT_CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
 #define EXPECT_FAILED "HTTP/1.1 417 Expectation Failed\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nExpectation Failed\r\n"
+#define ENTITY_TOO_LARGE "HTTP/1.1 413 Request Entity Too Large\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nRequest Entity Too Large\r\n"
 #define READ_BUF 16384
+/* response serializer. body parts up to OUT_COALESCE_PART bytes are copied
+   next to the header while the buffer is under OUT_COALESCE_MAX */
+#define OUT_COALESCE_PART 512
+#define OUT_COALESCE_MAX 65536
+/* room before serialized headers for status line, Date and Server */
+#define OUT_PREFIX_ROOM 256
+#define HEADER_CACHE_SIZE 4
+#define STATUS_LINE_MIN 100
+#define STATUS_LINE_MAX 599
+#define STATUS_LINE_LEN 48
+#define ACCEPT_WAIT_TIMEOUT 1.0
+/* spill file is preallocated this far ahead of the written bytes */
+#define SPILL_RESERVE_STEP (1024 * 1024)
+/* set_common_header flags. raw keys have no HTTP_ prefix. eager headers are
+   read by the server itself and never deferred by LazyEnv */
+#define COMMON_HEADER_RAW   1
+#define COMMON_HEADER_EAGER 2
 #define TOU(ch) (('a' <= ch && ch <= 'z') ? ch - ('a' - 'A') : ch)
 #define RETURN_STATUS_MESSAGE(s, l) l = sizeof(s) - 1; return s;
 
@@ -147,513 +207,3422 @@ static VALUE zero_string_val;
 static VALUE http10_val;
 static VALUE http11_val;
 
+struct common_method {
+  const char * name;
+  size_t name_len;
+  VALUE val;
+};
+static int common_methods_num = 0;
+static struct common_method common_methods[8];
+
+static long header_buf_size = MAX_HEADER_SIZE;
+static ID id_header_buf;
+static ID id_lazy_headers;
+static VALUE cInput;
+static VALUE cSpillBuffer;
+static int lazy_env = 0;
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+static ID id_for_fd;
+static VALUE for_fd_opts;
+/* IO objects for Fiber.scheduler, indexed by fd. cleared when rhebok closes the fd */
+static VALUE wait_ios;
+#endif
+
 static VALUE expect_key;
 
+static ID id_print;
+static ID id_each;
+
+enum {
+  CHUNKED_IN_CHUNK_SIZE,
+  CHUNKED_IN_CHUNK_EXT,
+  CHUNKED_IN_CHUNK_DATA,
+  CHUNKED_IN_CHUNK_CRLF,
+  CHUNKED_IN_TRAILERS_LINE_HEAD,
+  CHUNKED_IN_TRAILERS_LINE_MIDDLE
+};
+
+/* same state machine as picohttpparser's phr_chunked_decoder */
+struct chunked_decoder {
+  size_t bytes_left_in_chunk;
+  int hex_count;
+  int state;
+};
+
 struct common_header {
-  const char * name;
+  /* normalized as the env key without HTTP_, e.g. ACCEPT_ENCODING */
+  char name[MAX_COMMON_HEADER_NAME_LEN];
   size_t name_len;
   VALUE key;
+  int eager;
+  int next;
 };
 static int common_headers_num = 0;
-static struct common_header common_headers[20];
+static struct common_header common_headers[MAX_COMMON_HEADERS];
+/* 1-origin index of the first common header of each name length. 0 is none */
+static int common_headers_by_len[MAX_COMMON_HEADER_NAME_LEN + 1];
 
 static char date_buf[sizeof("Date: Sat, 19 Dec 2015 14:16:27 GMT\r\n")-1];
 
+/* header name to env key form: uppercase, '-' to '_' */
 static
-void set_common_header(const char * key, int key_len, const int raw)
+void _header_key_scalar(char *d, const char *s, size_t n)
 {
-  char tmp[MAX_HEADER_NAME_LEN + sizeof("HTTP_") - 1];
-  const char* name;
-  size_t name_len = 0;
-  const char * s;
-  char* d;
-  size_t n;
-  VALUE env_key;
-
-  if ( raw == 1) {
-    for (s = key, n = key_len, d = tmp;
-      n != 0;
-      s++, --n, d++) {
-      *d = *s == '-' ? '_' : TOU(*s);
-      name = tmp;
-      name_len = key_len;
-    }
-  } else {
-    strcpy(tmp, "HTTP_");
-    for (s = key, n = key_len, d = tmp + 5;
-      n != 0;
-      s++, --n, d++) {
-      *d = *s == '-' ? '_' : TOU(*s);
-      name = tmp;
-      name_len = key_len + 5;
-    }
-  }
-  env_key = rb_obj_freeze(rb_str_new(name,name_len));
-  common_headers[common_headers_num].name = key;
-  common_headers[common_headers_num].name_len = key_len;
-  common_headers[common_headers_num].key = env_key;
-  rb_gc_register_address(&common_headers[common_headers_num].key);
-  common_headers_num++;
+  for (; n != 0; s++, --n, d++) {
+    *d = *s == '-' ? '_' : TOU(*s);
+  }
 }
 
+/* returns where PATH_INFO ends ('?', '#' or len) and sets fragment_at to
+   where the request-target ends ('#' or len). escaped is set if PATH_INFO
+   contains '%' */
 static
-long find_lf(const char* v, ssize_t offset, ssize_t len)
+size_t _path_scan_scalar(const char *s, size_t i, size_t len, size_t *fragment_at, int *escaped)
 {
-  ssize_t i;
-  for ( i=offset; i < len; i++) {
-    if (v[i] == 10) {
+  const char *p;
+  for (; i < len; i++) {
+    if ( s[i] == '%' ) {
+      *escaped = 1;
+    }
+    else if ( s[i] == '#' ) {
+      *fragment_at = i;
+      return i;
+    }
+    else if ( s[i] == '?' ) {
+      p = memchr(s + i + 1, '#', len - i - 1);
+      *fragment_at = p ? (size_t)(p - s) : len;
       return i;
     }
   }
+  *fragment_at = len;
   return len;
 }
 
+static signed char hex_digit[256];
+
+/* decode one %xx at s into d. returns 0 if not a valid escape */
 static
-size_t find_ch(const char* s, size_t len, char ch)
+int _unescape1(char *d, const char *s, size_t len)
 {
-  size_t i;
-  for (i = 0; i != len; ++i, ++s)
-    if (*s == ch)
-      break;
-  return i;
+  int hi, lo;
+  if ( len < 3 ) {
+    return 0;
+  }
+  hi = hex_digit[(unsigned char)s[1]];
+  lo = hex_digit[(unsigned char)s[2]];
+  if ( hi < 0 || lo < 0 ) {
+    return 0;
+  }
+  *d = hi * 16 + lo;
+  return 1;
 }
 
+#ifdef USE_SIMD
 static
-int header_is(const struct phr_header* header, const char* name,
-                    size_t len)
+void _header_key_sse2(char *d, const char *s, size_t n)
 {
-  const char* x, * y;
-  if (header->name_len != len)
-    return 0;
-  for (x = header->name, y = name; len != 0; --len, ++x, ++y)
-    if (TOU(*x) != *y)
-      return 0;
-  return 1;
+  const __m128i a = _mm_set1_epi8('a' - 1);
+  const __m128i z = _mm_set1_epi8('z' + 1);
+  const __m128i dash = _mm_set1_epi8('-');
+  const __m128i flip = _mm_set1_epi8('-' ^ '_');
+  const __m128i upper = _mm_set1_epi8('a' - 'A');
+  __m128i v, lower;
+  for (; n >= 16; s += 16, d += 16, n -= 16) {
+    v = _mm_loadu_si128((const __m128i *)s);
+    /* bytes >= 0x80 are negative, never greater than 'a' - 1 */
+    lower = _mm_and_si128(_mm_cmpgt_epi8(v, a), _mm_cmplt_epi8(v, z));
+    v = _mm_sub_epi8(v, _mm_and_si128(lower, upper));
+    v = _mm_xor_si128(v, _mm_and_si128(_mm_cmpeq_epi8(v, dash), flip));
+    _mm_storeu_si128((__m128i *)d, v);
+  }
+  _header_key_scalar(d, s, n);
 }
 
+__attribute__((target("avx2")))
 static
-VALUE find_common_header(const struct phr_header* header) {
-  int i;
-  for ( i = 0; i < common_headers_num; i++ ) {
-    if ( header_is(header, common_headers[i].name, common_headers[i].name_len) ) {
-      return common_headers[i].key;
+void _header_key_avx2(char *d, const char *s, size_t n)
+{
+  const __m256i a = _mm256_set1_epi8('a' - 1);
+  const __m256i z = _mm256_set1_epi8('z' + 1);
+  const __m256i dash = _mm256_set1_epi8('-');
+  const __m256i flip = _mm256_set1_epi8('-' ^ '_');
+  const __m256i upper = _mm256_set1_epi8('a' - 'A');
+  __m256i v, lower;
+  for (; n >= 32; s += 32, d += 32, n -= 32) {
+    v = _mm256_loadu_si256((const __m256i *)s);
+    lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, a), _mm256_cmpgt_epi8(z, v));
+    v = _mm256_sub_epi8(v, _mm256_and_si256(lower, upper));
+    v = _mm256_xor_si256(v, _mm256_and_si256(_mm256_cmpeq_epi8(v, dash), flip));
+    _mm256_storeu_si256((__m256i *)d, v);
+  }
+  _header_key_sse2(d, s, n);
+}
+
+/* resolve a bitmask of '%', '?', '#' positions found at s[i] */
+static inline
+int _path_scan_mask(const char *s, size_t i, size_t len, unsigned int m,
+                    size_t *path_end, size_t *fragment_at, int *escaped)
+{
+  size_t at;
+  for (; m != 0; m &= m - 1) {
+    at = i + __builtin_ctz(m);
+    if ( s[at] == '%' ) {
+      *escaped = 1;
+      continue;
     }
+    *path_end = _path_scan_scalar(s, at, len, fragment_at, escaped);
+    return 1;
   }
-  return Qnil;
+  return 0;
 }
 
 static
-int store_path_info(VALUE env, const char* src, size_t src_len) {
-  int dlen = 0;
-  size_t i = 0;
-  char *d;
-  char s2, s3;
-  d = ALLOC_N(char, src_len * 3 + 1);
-  for (i = 0; i < src_len; i++ ) {
-    if ( src[i] == '%' ) {
-      if ( !isxdigit(src[i+1]) || !isxdigit(src[i+2]) ) {
-        free(d);
-        return -1;
-      }
-      s2 = src[i+1];
-      s3 = src[i+2];
-      s2 -= s2 <= '9' ? '0'
-          : s2 <= 'F' ? 'A' - 10
-          : 'a' - 10;
-      s3 -= s3 <= '9' ? '0'
-          : s3 <= 'F' ? 'A' - 10
-          : 'a' - 10;
-       d[dlen++] = s2 * 16 + s3;
-       i += 2;
+size_t _path_scan_sse2(const char *s, size_t i, size_t len, size_t *fragment_at, int *escaped)
+{
+  const __m128i pct = _mm_set1_epi8('%');
+  const __m128i q = _mm_set1_epi8('?');
+  const __m128i hash = _mm_set1_epi8('#');
+  __m128i v;
+  size_t path_end;
+  for (; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(s + i));
+    v = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, q)),
+                     _mm_cmpeq_epi8(v, hash));
+    if ( _path_scan_mask(s, i, len, _mm_movemask_epi8(v), &path_end, fragment_at, escaped) ) {
+      return path_end;
     }
-    else {
-      d[dlen++] = src[i];
+  }
+  return _path_scan_scalar(s, i, len, fragment_at, escaped);
+}
+
+__attribute__((target("avx2")))
+static
+size_t _path_scan_avx2(const char *s, size_t i, size_t len, size_t *fragment_at, int *escaped)
+{
+  const __m256i pct = _mm256_set1_epi8('%');
+  const __m256i q = _mm256_set1_epi8('?');
+  const __m256i hash = _mm256_set1_epi8('#');
+  __m256i v;
+  size_t path_end;
+  for (; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(s + i));
+    v = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, pct), _mm256_cmpeq_epi8(v, q)),
+                        _mm256_cmpeq_epi8(v, hash));
+    if ( _path_scan_mask(s, i, len, (unsigned int)_mm256_movemask_epi8(v), &path_end, fragment_at, escaped) ) {
+      return path_end;
     }
   }
-  d[dlen]='0';
-  rb_hash_aset(env, path_info_key, rb_str_new(d, dlen));
-  xfree(d);
-  return dlen;
+  return _path_scan_sse2(s, i, len, fragment_at, escaped);
+}
+
+/* hex digit value per byte, 0xff lanes for non hex digits */
+__attribute__((target("ssse3")))
+static inline
+__m128i _hex_value_ssse3(__m128i x)
+{
+  const __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+  const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+  const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  return _mm_or_si128(
+    _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(x, _mm_set1_epi8('0'))),
+                 _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)))),
+    _mm_andnot_si128(_mm_or_si128(digit, alpha), _mm_set1_epi8(-1)));
 }
 
+/* decode a run of five %xx from 16 readable bytes at s. d must have 16
+   writable bytes. returns 0 unless all five escapes are valid */
+__attribute__((target("ssse3")))
 static
-int _accept(int fileno, struct sockaddr *addr, unsigned int addrlen) {
-  int fd;
-#ifdef SOCK_NONBLOCK
-  fd = accept4(fileno, addr, &addrlen, SOCK_CLOEXEC|SOCK_NONBLOCK);
-#else
-  fd = accept(fileno, addr, &addrlen);
+int _unescape5_ssse3(char *d, const char *s)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *)s);
+  __m128i hi, lo;
+  if ( (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%'))) & 0x1249) != 0x1249 ) {
+    return 0;
+  }
+  hi = _hex_value_ssse3(_mm_shuffle_epi8(v, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)));
+  lo = _hex_value_ssse3(_mm_shuffle_epi8(v, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)));
+  if ( (_mm_movemask_epi8(_mm_or_si128(hi, lo)) & 0x1f) != 0 ) {
+    return 0;
+  }
+  _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_slli_epi16(hi, 4), lo));
+  return 1;
+}
 #endif
-  if (fd < 0) {
-    if ( errno == EINTR ) {
-      rb_thread_sleep(1);
-    }
-    return fd;
+
+static void (*header_key)(char *d, const char *s, size_t n) = _header_key_scalar;
+static size_t (*path_scan)(const char *s, size_t i, size_t len, size_t *fragment_at, int *escaped) = _path_scan_scalar;
+#ifdef USE_SIMD
+static int unescape_simd = 0;
+#endif
+
+static
+void _init_simd(void)
+{
+  int i;
+  memset(hex_digit, -1, sizeof(hex_digit));
+  for ( i = 0; i < 10; i++ ) {
+    hex_digit['0' + i] = i;
   }
-#ifndef SOCK_NONBLOCK
-  fcntl(fd, F_SETFD, FD_CLOEXEC);
-  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  for ( i = 0; i < 6; i++ ) {
+    hex_digit['a' + i] = hex_digit['A' + i] = 10 + i;
+  }
+#ifdef USE_SIMD
+  __builtin_cpu_init();
+  header_key = _header_key_sse2;
+  path_scan = _path_scan_sse2;
+  if ( __builtin_cpu_supports("avx2") ) {
+    header_key = _header_key_avx2;
+    path_scan = _path_scan_avx2;
+  }
+  unescape_simd = __builtin_cpu_supports("ssse3");
 #endif
-  return fd;
 }
 
 static
-ssize_t _writev_timeout(const int fileno, const double timeout, struct iovec *iovec, const long iovcnt, const int do_select ) {
-  ssize_t rv;
-  int nfound;
-  int iovcnt_len;
-  struct pollfd wfds[1];
-  if ( iovcnt < 0 ){
-      return -1;
+void set_common_header(const char * key, int key_len, const int flags)
+{
+  char tmp[MAX_HEADER_NAME_LEN + sizeof("HTTP_") - 1] = "HTTP_";
+  struct common_header *h = &common_headers[common_headers_num];
+
+  header_key(tmp + 5, key, key_len);
+  memcpy(h->name, tmp + 5, key_len);
+  h->name_len = key_len;
+  h->key = rb_obj_freeze((flags & COMMON_HEADER_RAW) ? rb_str_new(tmp + 5, key_len) : rb_str_new(tmp, key_len + 5));
+  h->eager = flags != 0;
+  rb_gc_register_address(&h->key);
+  h->next = common_headers_by_len[key_len];
+  common_headers_by_len[key_len] = common_headers_num + 1;
+  common_headers_num++;
+}
+
+static
+void set_common_method(const char * name, size_t name_len)
+{
+  common_methods[common_methods_num].name = name;
+  common_methods[common_methods_num].name_len = name_len;
+  common_methods[common_methods_num].val = rb_obj_freeze(rb_str_new(name, name_len));
+  rb_gc_register_address(&common_methods[common_methods_num].val);
+  common_methods_num++;
+}
+
+static
+VALUE request_method_value(const char * method, size_t method_len)
+{
+  int i;
+  for ( i = 0; i < common_methods_num; i++ ) {
+    if ( common_methods[i].name_len == method_len &&
+         memcmp(common_methods[i].name, method, method_len) == 0 ) {
+      return common_methods[i].val;
+    }
   }
-  if ( iovcnt > UINT_MAX ) {
-      iovcnt_len = UINT_MAX;
+  return rb_str_new(method, method_len);
+}
+
+static
+long find_lf(const char* v, ssize_t offset, ssize_t len)
+{
+  const char *p;
+  if ( offset >= len ) {
+    return len;
   }
-  else {
-      iovcnt_len = (int)iovcnt;
+  /* libc memchr is already vectorized */
+  p = memchr(v + offset, '\n', len - offset);
+  return p ? p - v : len;
+}
+
+/* name is normalized by header_key */
+static
+const struct common_header * find_common_header(const char* name, size_t name_len) {
+  int i;
+  if ( name_len > MAX_COMMON_HEADER_NAME_LEN ) {
+    return NULL;
   }
-  if ( do_select == 1) goto WAIT_WRITE;
- DO_WRITE:
-  rv = writev(fileno, iovec, iovcnt_len);
-  if ( rv >= 0 ) {
-    return rv;
+  for ( i = common_headers_by_len[name_len]; i != 0; i = common_headers[i-1].next ) {
+    if ( memcmp(name, common_headers[i-1].name, name_len) == 0 ) {
+      return &common_headers[i-1];
+    }
   }
-  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
-    return rv;
+  return NULL;
+}
+
+static
+VALUE path_info_value(const char* src, size_t src_len, int escaped) {
+  size_t dlen = 0;
+  size_t i = 0;
+  const char *p;
+  char *d;
+  VALUE path_info;
+  if ( !escaped ) {
+    return rb_str_new(src, src_len);
   }
- WAIT_WRITE:
-  while (1) {
-    wfds[0].fd = fileno;
-    wfds[0].events = POLLOUT;
-    nfound = poll(wfds, 1, (int)(timeout*1000));
-    if ( nfound == 1 ) {
+  /* decoded path is never longer than src. decode into the String itself */
+  path_info = rb_str_new(NULL, src_len);
+  d = RSTRING_PTR(path_info);
+  while ( i < src_len ) {
+    p = memchr(src + i, '%', src_len - i);
+    if ( p == NULL ) {
+      memcpy(d + dlen, src + i, src_len - i);
+      dlen += src_len - i;
       break;
     }
-    if ( nfound == 0 && errno != EINTR ) {
-      return -1;
+    memcpy(d + dlen, src + i, p - (src + i));
+    dlen += p - (src + i);
+    i = p - src;
+#ifdef USE_SIMD
+    /* multibyte characters come as runs of escapes. dlen <= i, so d has
+       as many writable bytes as src has left */
+    if ( unescape_simd ) {
+      while ( i + 16 <= src_len && _unescape5_ssse3(d + dlen, src + i) ) {
+        dlen += 5;
+        i += 15;
+      }
+    }
+#endif
+    while ( i < src_len && src[i] == '%' ) {
+      if ( !_unescape1(d + dlen, src + i, src_len - i) ) {
+        return Qnil;
+      }
+      dlen++;
+      i += 3;
     }
   }
-  goto DO_WRITE;
+  rb_str_set_len(path_info, dlen);
+  return path_info;
 }
 
-static
-ssize_t _read_timeout(const int fileno, const double timeout, char * read_buf, const ssize_t read_len ) {
-  ssize_t rv;
+struct poll_args {
+  struct pollfd *fds;
+  int timeout;
   int nfound;
-  struct pollfd rfds[1];
- DO_READ:
-  rfds[0].fd = fileno;
-  rfds[0].events = POLLIN;
-  //rv = read(fileno, read_buf, read_len);
-  rv = recvfrom(fileno, read_buf, read_len, 0, NULL, NULL);
-  if ( rv >= 0 ) {
-    return rv;
+};
+
+static
+void * _poll_without_gvl(void *ptr) {
+  struct poll_args *args = (struct poll_args *)ptr;
+  args->nfound = poll(args->fds, 1, args->timeout);
+  return NULL;
+}
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+/* wait in Fiber.scheduler, other fibers run meanwhile. returns 1 if ready, 0 on timeout */
+static
+int _scheduler_wait(VALUE scheduler, const int fileno, const short events, const double timeout) {
+  VALUE args[2];
+  VALUE io;
+  VALUE result;
+  io = rb_ary_entry(wait_ios, fileno);
+  if ( NIL_P(io) ) {
+    args[0] = INT2NUM(fileno);
+    args[1] = for_fd_opts;
+    /* fd is owned by rhebok. the IO only tells the scheduler what to watch */
+    io = rb_funcallv_kw(rb_cIO, id_for_fd, 2, args, RB_PASS_KEYWORDS);
+    rb_ary_store(wait_ios, fileno, io);
   }
-  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
-    return rv;
+  result = rb_fiber_scheduler_io_wait(scheduler, io,
+                                      INT2NUM(events == POLLIN ? RUBY_IO_READABLE : RUBY_IO_WRITABLE),
+                                      DBL2NUM(timeout));
+  RB_GC_GUARD(io);
+  if ( !RTEST(result) || result == INT2FIX(0) ) {
+    return 0;
   }
-  while (1) {
-    nfound = poll(rfds, 1, (int)(timeout*1000));
-    if ( nfound == 1 ) {
-      break;
-    }
-    if ( nfound == 0 && errno != EINTR ) {
-      return -1;
+  return 1;
+}
+#endif
+
+/* poll single fd. other threads can run while waiting */
+static
+int _poll_fd(const int fileno, const short events, const double timeout) {
+  struct pollfd fds[1];
+  struct poll_args args;
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  VALUE scheduler = rb_fiber_scheduler_current();
+  if ( !NIL_P(scheduler) ) {
+    if ( _scheduler_wait(scheduler, fileno, events, timeout) == 0 ) {
+      errno = ETIMEDOUT;
+      return 0;
     }
+    return 1;
   }
-  goto DO_READ;
+#endif
+  fds[0].fd = fileno;
+  fds[0].events = events;
+  args.fds = fds;
+  args.timeout = (int)(timeout*1000);
+  /* not called if interrupt is pending */
+  args.nfound = -1;
+  errno = EINTR;
+  rb_thread_call_without_gvl(_poll_without_gvl, &args, RUBY_UBF_IO, NULL);
+  if ( args.nfound == 0 ) {
+    errno = ETIMEDOUT;
+  }
+  else if ( args.nfound < 0 && errno == EINTR ) {
+    /* run signal handlers, raise if the thread is killed */
+    rb_thread_check_ints();
+    errno = EINTR;
+  }
+  return args.nfound;
 }
 
+#ifdef USE_IO_URING
+#define URING_ENTRIES 64
+#define URING_OP_DATA 1
+#define URING_TIMEOUT_DATA 2
+#define URING_ACCEPT_DATA 3
+#define URING_CANCEL_DATA 4
+
+static int io_uring_enabled = 0;
+static int multishot_accept = 0;
+
+struct rhe_uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_sqe *sqes;
+  void * ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+  /* registered header buffer */
+  char * fixed_buf;
+  long fixed_buf_size;
+  /* result of the running op */
+  int op_done;
+  int op_res;
+  int timeout_done;
+  /* multishot accept */
+  int multishot_listener;
+  int multishot_disabled;
+  int * accepted;
+  long accepted_head;
+  long accepted_num;
+  long accepted_capa;
+};
+
+struct uring_enter_args {
+  int fd;
+  unsigned to_submit;
+  unsigned min_complete;
+  unsigned flags;
+  void * arg;
+  size_t argsz;
+  int ret;
+};
+#endif
+
+/* serialized headers of a frozen header Hash whose keys and values are all
+   frozen Strings. Date and Server are kept apart */
+struct header_cache {
+  VALUE headers;
+  char * buf;
+  long len;
+  long size;
+  VALUE date;
+  VALUE server;
+  int has_length;
+};
+
+struct header_arena {
+  char * buf;
+  long size;
+  /* response bytes and iovecs of write_response */
+  char * out;
+  long out_size;
+  struct iovec * iov;
+  long iov_size;
+  struct header_cache hcache[HEADER_CACHE_SIZE];
+  int hcache_next;
+  /* phase start times of the thread for metrics, in ns. 0 is none */
+  long long accept_started;
+  long long app_started;
+  long long write_started;
+#ifdef USE_IO_URING
+  struct rhe_uring * ring;
+  int ring_failed;
+#endif
+};
+
+#ifdef USE_IO_URING
 static
-ssize_t _write_timeout(const int fileno, const double timeout, char * write_buf, const long write_len ) {
-  ssize_t rv;
-  int nfound;
-  struct pollfd wfds[1];
-  size_t write_buf_len;
-  if ( write_len < 0 ) {
-      return -1;
+struct rhe_uring * _uring_new(void) {
+  struct io_uring_params params;
+  struct rhe_uring *ring;
+  size_t sq_size, cq_size;
+  int fd;
+
+  memset(&params, 0, sizeof(params));
+  fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if ( fd < 0 ) {
+    return NULL;
   }
-  if ( write_len > UINT_MAX ) {
-      write_buf_len = UINT_MAX;
+  if ( !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ) {
+    close(fd);
+    return NULL;
   }
-  else {
-      write_buf_len = (unsigned int)write_len;
+  ring = ALLOC(struct rhe_uring);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = fd;
+  ring->multishot_listener = -1;
+  ring->sq_entries = params.sq_entries;
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if ( ring->ring_ptr == MAP_FAILED ) {
+    close(fd);
+    xfree(ring);
+    return NULL;
   }
-  
- DO_WRITE:
-  rv = write(fileno, write_buf, write_buf_len);
-  if ( rv >= 0 ) {
-    return rv;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if ( ring->sqes == MAP_FAILED ) {
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(fd);
+    xfree(ring);
+    return NULL;
   }
-  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
-    return rv;
+  ring->sq_head = (unsigned *)((char *)ring->ring_ptr + params.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->ring_ptr + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->ring_ptr + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->ring_ptr + params.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->ring_ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->ring_ptr + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->ring_ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->ring_ptr + params.cq_off.cqes);
+  return ring;
+}
+
+static
+void _uring_free(struct rhe_uring *ring) {
+  long i;
+  /* closing the ring cancels requests in flight */
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->ring_ptr, ring->ring_size);
+  close(ring->fd);
+  for ( i = 0; i < ring->accepted_num; i++ ) {
+    close(ring->accepted[(ring->accepted_head + i) % ring->accepted_capa]);
   }
-  while (1) {
-    wfds[0].fd = fileno;
-    wfds[0].events = POLLOUT;
-    nfound = poll(wfds, 1, (int)(timeout*1000));
-    if ( nfound == 1 ) {
-      break;
-    }
-    if ( nfound == 0 && errno != EINTR ) {
-      return -1;
-    }
+  if ( ring->accepted != NULL ) {
+    xfree(ring->accepted);
   }
-  goto DO_WRITE;
+  xfree(ring);
 }
 
+/* register header buffer for IORING_OP_READ_FIXED */
 static
-void str_s(char * dst, int *dst_len, const char * src, const unsigned long src_len) {
-  unsigned long i;
-  int dlen = *dst_len;
-  for ( i=0; i<src_len; i++) {
-    dst[dlen++] = src[i];
+void _uring_register_buf(struct rhe_uring *ring, char *buf, long size) {
+  struct iovec iov;
+  if ( ring->fixed_buf != NULL ) {
+    syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    ring->fixed_buf = NULL;
+    ring->fixed_buf_size = 0;
+  }
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  if ( syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0 ) {
+    ring->fixed_buf = buf;
+    ring->fixed_buf_size = size;
   }
-  *dst_len = dlen;
 }
+#endif
 
 static
-void str_i(char * dst, int * dst_len, int src, int fig) {
-  int dlen = *dst_len + fig - 1;
-  do {
-    dst[dlen] = '0' + (src % 10);
-    dlen--;
-    src /= 10;
-  } while( dlen >= *dst_len );
-  *dst_len += fig;
+void _header_arena_mark(void *ptr) {
+  struct header_arena *arena = (struct header_arena *)ptr;
+  int i;
+  for ( i = 0; i < HEADER_CACHE_SIZE; i++ ) {
+    if ( arena->hcache[i].headers ) {
+      rb_gc_mark(arena->hcache[i].headers);
+      rb_gc_mark(arena->hcache[i].date);
+      rb_gc_mark(arena->hcache[i].server);
+    }
+  }
 }
 
 static
-int _chunked_header(char *buf, ssize_t len) {
-    int dlen = 0, i;
-    ssize_t l = len;
-    while ( l > 0 ) {
-        dlen++;
-        l /= 16;
+void _header_arena_free(void *ptr) {
+  struct header_arena *arena = (struct header_arena *)ptr;
+  int i;
+  for ( i = 0; i < HEADER_CACHE_SIZE; i++ ) {
+    if ( arena->hcache[i].buf != NULL ) {
+      xfree(arena->hcache[i].buf);
     }
-    i = dlen;
-    buf[i++] = 13;
-    buf[i++] = 10;
+  }
+  if ( arena->out != NULL ) {
+    xfree(arena->out);
+  }
+  if ( arena->iov != NULL ) {
+    xfree(arena->iov);
+  }
+#ifdef USE_IO_URING
+  if ( arena->ring != NULL ) {
+    _uring_free(arena->ring);
+  }
+#endif
+  if ( arena->buf != NULL ) {
+    xfree(arena->buf);
+  }
+  xfree(arena);
+}
+
+static
+size_t _header_arena_memsize(const void *ptr) {
+  const struct header_arena *arena = (const struct header_arena *)ptr;
+  size_t size = sizeof(*arena) + arena->size + arena->out_size + arena->iov_size * sizeof(struct iovec);
+  int i;
+  for ( i = 0; i < HEADER_CACHE_SIZE; i++ ) {
+    size += arena->hcache[i].size;
+  }
+  return size;
+}
+
+static const rb_data_type_t header_arena_type = {
+  "rhebok_header_arena",
+  { _header_arena_mark, _header_arena_free, _header_arena_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* per-thread buffers, and io_uring if enabled */
+static
+struct header_arena * _header_arena(void) {
+  VALUE thread = rb_thread_current();
+  VALUE arenav = rb_thread_local_aref(thread, id_header_buf);
+  struct header_arena *arena;
+  if ( NIL_P(arenav) ) {
+    arenav = TypedData_Make_Struct(rb_cObject, struct header_arena, &header_arena_type, arena);
+    rb_thread_local_aset(thread, id_header_buf, arenav);
+  }
+  else {
+    TypedData_Get_Struct(arenav, struct header_arena, &header_arena_type, arena);
+  }
+  return arena;
+}
+
+/* header read buffer. one per thread, reused across requests */
+static
+char * _header_buf(long * sizep) {
+  struct header_arena *arena = _header_arena();
+  if ( arena->size != header_buf_size ) {
+    REALLOC_N(arena->buf, char, header_buf_size);
+    arena->size = header_buf_size;
+#ifdef USE_IO_URING
+    if ( arena->ring != NULL ) {
+      _uring_register_buf(arena->ring, arena->buf, arena->size);
+    }
+#endif
+  }
+  *sizep = arena->size;
+  return arena->buf;
+}
+
+#ifdef USE_IO_URING
+/* ring of current thread. NULL if io_uring is disabled or in fiber mode */
+static
+struct rhe_uring * _uring_current(void) {
+  struct header_arena *arena;
+  if ( !io_uring_enabled ) {
+    return NULL;
+  }
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  if ( !NIL_P(rb_fiber_scheduler_current()) ) {
+    return NULL;
+  }
+#endif
+  arena = _header_arena();
+  if ( arena->ring == NULL && !arena->ring_failed ) {
+    arena->ring = _uring_new();
+    if ( arena->ring == NULL ) {
+      arena->ring_failed = 1;
+      return NULL;
+    }
+    if ( arena->buf != NULL ) {
+      _uring_register_buf(arena->ring, arena->buf, arena->size);
+    }
+  }
+  return arena->ring;
+}
+
+/* hand queued sqes to the kernel without waiting, to make room in the queue */
+static
+void _uring_submit(struct rhe_uring *ring) {
+  unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if ( to_submit > 0 ) {
+    syscall(__NR_io_uring_enter, ring->fd, to_submit, 0, 0, NULL, 0);
+  }
+}
+
+/* make sure n sqes can be queued. returns 0, or -1 with EBUSY if the queue stays full */
+static
+int _uring_reserve(struct rhe_uring *ring, const unsigned n) {
+  if ( *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + n <= ring->sq_entries ) {
+    return 0;
+  }
+  _uring_submit(ring);
+  if ( *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + n <= ring->sq_entries ) {
+    return 0;
+  }
+  errno = EBUSY;
+  return -1;
+}
+
+/* next free sqe, NULL if the submission queue is full */
+static
+struct io_uring_sqe * _uring_sqe(struct rhe_uring *ring) {
+  unsigned tail;
+  unsigned idx;
+  struct io_uring_sqe *sqe;
+  if ( _uring_reserve(ring, 1) < 0 ) {
+    return NULL;
+  }
+  tail = *ring->sq_tail;
+  idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  /* kernel reads sqes only in io_uring_enter */
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static
+void _uring_accepted_push(struct rhe_uring *ring, int fd) {
+  long i;
+  int *accepted;
+  if ( ring->accepted_num == ring->accepted_capa ) {
+    /* grow and unwrap */
+    long capa = ring->accepted_capa == 0 ? 16 : ring->accepted_capa * 2;
+    accepted = ALLOC_N(int, capa);
+    for ( i = 0; i < ring->accepted_num; i++ ) {
+      accepted[i] = ring->accepted[(ring->accepted_head + i) % ring->accepted_capa];
+    }
+    if ( ring->accepted != NULL ) {
+      xfree(ring->accepted);
+    }
+    ring->accepted = accepted;
+    ring->accepted_capa = capa;
+    ring->accepted_head = 0;
+  }
+  ring->accepted[(ring->accepted_head + ring->accepted_num) % ring->accepted_capa] = fd;
+  ring->accepted_num++;
+}
+
+static
+int _uring_accepted_shift(struct rhe_uring *ring) {
+  int fd;
+  if ( ring->accepted_num == 0 ) {
+    return -1;
+  }
+  fd = ring->accepted[ring->accepted_head];
+  ring->accepted_head = (ring->accepted_head + 1) % ring->accepted_capa;
+  ring->accepted_num--;
+  return fd;
+}
+
+static
+void _uring_reap(struct rhe_uring *ring) {
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe *cqe;
+  while ( head != tail ) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    switch ( cqe->user_data ) {
+    case URING_OP_DATA:
+      ring->op_res = cqe->res;
+      ring->op_done = 1;
+      break;
+    case URING_TIMEOUT_DATA:
+      ring->timeout_done = 1;
+      break;
+    case URING_ACCEPT_DATA:
+      if ( cqe->res >= 0 ) {
+        _uring_accepted_push(ring, cqe->res);
+      }
+      else if ( cqe->res == -EINVAL ) {
+        /* kernel without multishot accept */
+        ring->multishot_disabled = 1;
+      }
+      if ( !(cqe->flags & IORING_CQE_F_MORE) ) {
+        ring->multishot_listener = -1;
+      }
+      break;
+    }
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static
+void * _uring_enter_without_gvl(void *ptr) {
+  struct uring_enter_args *args = (struct uring_enter_args *)ptr;
+  args->ret = (int)syscall(__NR_io_uring_enter, args->fd, args->to_submit, args->min_complete,
+                           args->flags, args->arg, args->argsz);
+  return NULL;
+}
+
+/* submit queued sqes and wait for a completion. returns -1 with errno on error.
+   never raises, the caller has to check interrupts after requests are done */
+static
+int _uring_enter(struct rhe_uring *ring, unsigned flags, void *arg, size_t argsz, const int with_gvl) {
+  struct uring_enter_args args;
+  args.fd = ring->fd;
+  args.to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  args.min_complete = 1;
+  args.flags = IORING_ENTER_GETEVENTS | flags;
+  args.arg = arg;
+  args.argsz = argsz;
+  args.ret = INT_MIN;
+  if ( with_gvl ) {
+    _uring_enter_without_gvl(&args);
+  }
+  else {
+    rb_thread_call_without_gvl2(_uring_enter_without_gvl, &args, RUBY_UBF_IO, NULL);
+  }
+  if ( args.ret == INT_MIN ) {
+    /* interrupt was pending. nothing is entered */
+    errno = EINTR;
+    return -1;
+  }
+  return args.ret;
+}
+
+/* run the queued op linked with a timeout, and wait for both to complete.
+   on interrupt, the op is canceled before returning EINTR, so no buffer
+   is left in use by the kernel. the caller reserves sqes for both */
+static
+ssize_t _uring_run(struct rhe_uring *ring, const double timeout) {
+  struct __kernel_timespec ts;
+  struct io_uring_sqe *sqe;
+  int canceled = 0;
+
+  ts.tv_sec = (long long)timeout;
+  ts.tv_nsec = (long long)((timeout - (double)ts.tv_sec) * 1000000000);
+  sqe = _uring_sqe(ring);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (unsigned long)&ts;
+  sqe->len = 1;
+  sqe->user_data = URING_TIMEOUT_DATA;
+  ring->op_done = 0;
+  ring->timeout_done = 0;
+
+  while ( !ring->op_done || !ring->timeout_done ) {
+    /* cancellation completes soon, wait it with GVL */
+    if ( _uring_enter(ring, 0, NULL, 0, canceled) < 0 && errno == EINTR && !canceled ) {
+      sqe = _uring_sqe(ring);
+      if ( sqe != NULL ) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_OP_DATA;
+        sqe->user_data = URING_CANCEL_DATA;
+        canceled = 1;
+      }
+    }
+    _uring_reap(ring);
+  }
+  if ( ring->op_res >= 0 ) {
+    return ring->op_res;
+  }
+  if ( ring->op_res == -ECANCELED ) {
+    errno = canceled ? EINTR : ETIMEDOUT;
+    return -1;
+  }
+  errno = -ring->op_res;
+  return -1;
+}
+
+static
+ssize_t _uring_recv(struct rhe_uring *ring, const int fileno, const double timeout, char * read_buf, const ssize_t read_len) {
+  struct io_uring_sqe *sqe;
+  if ( _uring_reserve(ring, 2) < 0 ) {
+    return -1;
+  }
+  sqe = _uring_sqe(ring);
+  if ( read_buf >= ring->fixed_buf && read_buf + read_len <= ring->fixed_buf + ring->fixed_buf_size ) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = 0;
+  }
+  else {
+    sqe->opcode = IORING_OP_RECV;
+  }
+  sqe->fd = fileno;
+  sqe->addr = (unsigned long)read_buf;
+  sqe->len = read_len;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = URING_OP_DATA;
+  return _uring_run(ring, timeout);
+}
+
+static
+ssize_t _uring_send(struct rhe_uring *ring, const int fileno, const double timeout, struct iovec *iovec, const int iovcnt, const int more) {
+  struct msghdr msg;
+  struct io_uring_sqe *sqe;
+  if ( _uring_reserve(ring, 2) < 0 ) {
+    return -1;
+  }
+  sqe = _uring_sqe(ring);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iovec;
+  msg.msg_iovlen = iovcnt;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fileno;
+  sqe->addr = (unsigned long)&msg;
+  sqe->len = 1;
+#ifdef MSG_MORE
+  sqe->msg_flags = more ? MSG_MORE : 0;
+#endif
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = URING_OP_DATA;
+  return _uring_run(ring, timeout);
+}
+
+/* accept with io_uring. returns -1 with EAGAIN if no connection within ACCEPT_WAIT_TIMEOUT,
+   or with EBUSY if the submission queue is full */
+static
+int _uring_accept(struct rhe_uring *ring, const int fileno) {
+  struct io_uring_sqe *sqe;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  int fd;
+
+  fd = _uring_accepted_shift(ring);
+  if ( fd >= 0 ) {
+    return fd;
+  }
+  if ( !multishot_accept || ring->multishot_disabled ) {
+    if ( _uring_reserve(ring, 2) < 0 ) {
+      return -1;
+    }
+    sqe = _uring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fileno;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_OP_DATA;
+    fd = (int)_uring_run(ring, ACCEPT_WAIT_TIMEOUT);
+    if ( fd < 0 && errno == ETIMEDOUT ) {
+      errno = EAGAIN;
+    }
+    return fd;
+  }
+
+  /* one request keeps accepting connections into the completion queue */
+  if ( ring->multishot_listener != fileno ) {
+    if ( (sqe = _uring_sqe(ring)) == NULL ) {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fileno;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT_DATA;
+    ring->multishot_listener = fileno;
+  }
+  ts.tv_sec = (long long)ACCEPT_WAIT_TIMEOUT;
+  ts.tv_nsec = 0;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (unsigned long)&ts;
+  _uring_enter(ring, IORING_ENTER_EXT_ARG, &arg, sizeof(arg), 0);
+  _uring_reap(ring);
+  /* multishot accept does not use buffers. safe to raise */
+  rb_thread_check_ints();
+  fd = _uring_accepted_shift(ring);
+  if ( fd < 0 ) {
+    errno = EAGAIN;
+  }
+  return fd;
+}
+
+/* stop multishot accept and keep accepted connections in queue */
+static
+void _uring_stop_multishot(struct rhe_uring *ring) {
+  struct io_uring_sqe *sqe;
+  if ( ring->multishot_listener < 0 ) {
+    return;
+  }
+  if ( (sqe = _uring_sqe(ring)) == NULL ) {
+    /* left armed. accepted connections are still taken from the queue */
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = URING_ACCEPT_DATA;
+  sqe->user_data = URING_CANCEL_DATA;
+  while ( ring->multishot_listener >= 0 ) {
+    _uring_enter(ring, 0, NULL, 0, 1);
+    _uring_reap(ring);
+  }
+}
+#endif
+
+struct accept_args {
+  int fileno;
+  struct sockaddr *addr;
+  socklen_t addrlen;
+  int fd;
+};
+
+static
+void * _accept_without_gvl(void *ptr) {
+  struct accept_args *args = (struct accept_args *)ptr;
+#ifdef SOCK_NONBLOCK
+  args->fd = accept4(args->fileno, args->addr, &args->addrlen, SOCK_CLOEXEC|SOCK_NONBLOCK);
+#else
+  args->fd = accept(args->fileno, args->addr, &args->addrlen);
+#endif
+  return NULL;
+}
+
+static
+int _accept_fd_setup(int fd) {
+#ifndef SOCK_NONBLOCK
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+  return fd;
+}
+
+#ifdef USE_EXCLUSIVE_ACCEPT
+static int exclusive_accept = 0;
+static int accept_epfd = -1;
+static int accept_epfd_listener = -1;
+static pid_t accept_epfd_pid = 0;
+
+struct epoll_wait_args {
+  int epfd;
+  int nfound;
+};
+
+static
+void * _epoll_wait_without_gvl(void *ptr) {
+  struct epoll_wait_args *args = (struct epoll_wait_args *)ptr;
+  struct epoll_event ev;
+  args->nfound = epoll_wait(args->epfd, &ev, 1, -1);
+  return NULL;
+}
+
+/* epoll instance of this worker process. the listener is registered
+   with EPOLLEXCLUSIVE so one connection wakes up only one worker */
+static
+int _accept_epfd(int fileno) {
+  struct epoll_event ev;
+  pid_t pid = getpid();
+  if ( accept_epfd >= 0 && accept_epfd_pid == pid && accept_epfd_listener == fileno ) {
+    return accept_epfd;
+  }
+  if ( accept_epfd >= 0 ) {
+    /* inherited from parent or registered with another listener */
+    close(accept_epfd);
+    accept_epfd = -1;
+  }
+  accept_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if ( accept_epfd < 0 ) {
+    return -1;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.fd = fileno;
+  if ( epoll_ctl(accept_epfd, EPOLL_CTL_ADD, fileno, &ev) < 0 ) {
+    close(accept_epfd);
+    accept_epfd = -1;
+    return -1;
+  }
+  accept_epfd_pid = pid;
+  accept_epfd_listener = fileno;
+  return accept_epfd;
+}
+#endif
+
+static
+int _accept(int fileno, struct sockaddr *addr, unsigned int addrlen) {
+  int fd;
+  struct accept_args args;
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  VALUE scheduler = rb_fiber_scheduler_current();
+#endif
+  args.fileno = fileno;
+  args.addr = addr;
+  args.addrlen = addrlen;
+  args.fd = -1;
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  if ( !NIL_P(scheduler) ) {
+    /* listener is nonblocking in fiber mode. wait a while, then let
+       the caller check signals and request count */
+    _accept_without_gvl(&args);
+    if ( args.fd < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) &&
+         _scheduler_wait(scheduler, fileno, POLLIN, ACCEPT_WAIT_TIMEOUT) == 1 ) {
+      args.addrlen = addrlen;
+      _accept_without_gvl(&args);
+    }
+    if ( args.fd < 0 ) {
+      return args.fd;
+    }
+    return _accept_fd_setup(args.fd);
+  }
+#endif
+#ifdef USE_IO_URING
+  {
+    struct rhe_uring *ring = _uring_current();
+    if ( ring != NULL ) {
+      fd = _uring_accept(ring, fileno);
+      if ( fd >= 0 ) {
+        getpeername(fd, addr, &args.addrlen);
+      }
+      else if ( errno == EINTR ) {
+        /* accept request is already canceled */
+        rb_thread_check_ints();
+      }
+      if ( fd >= 0 || errno != EBUSY ) {
+        return fd;
+      }
+      /* submission queue is full, accept without io_uring */
+    }
+  }
+#endif
+#ifdef USE_EXCLUSIVE_ACCEPT
+  if ( exclusive_accept ) {
+    /* listener is nonblocking. another worker may take the connection */
+    struct epoll_wait_args eargs;
+    eargs.epfd = _accept_epfd(fileno);
+    if ( eargs.epfd < 0 ) {
+      return -1;
+    }
+    eargs.nfound = -1;
+    errno = EINTR;
+    rb_thread_call_without_gvl(_epoll_wait_without_gvl, &eargs, RUBY_UBF_IO, NULL);
+    if ( eargs.nfound <= 0 ) {
+      if ( errno == EINTR ) {
+        rb_thread_check_ints();
+      }
+      return -1;
+    }
+    _accept_without_gvl(&args);
+    if ( args.fd < 0 ) {
+      return args.fd;
+    }
+    return _accept_fd_setup(args.fd);
+  }
+#endif
+  errno = EINTR;
+  rb_thread_call_without_gvl(_accept_without_gvl, &args, RUBY_UBF_IO, NULL);
+  fd = args.fd;
+  if (fd < 0) {
+    if ( errno == EINTR ) {
+      rb_thread_sleep(1);
+    }
+    return fd;
+  }
+  return _accept_fd_setup(fd);
+}
+
+static
+ssize_t _writev_timeout(const int fileno, const double timeout, struct iovec *iovec, const long iovcnt, const int do_select, const int more ) {
+  ssize_t rv;
+  int nfound;
+  int iovcnt_len;
+#ifdef MSG_MORE
+  struct msghdr msg;
+#endif
+  if ( iovcnt < 0 ){
+      return -1;
+  }
+  if ( iovcnt > UINT_MAX ) {
+      iovcnt_len = UINT_MAX;
+  }
+  else {
+      iovcnt_len = (int)iovcnt;
+  }
+#ifdef USE_IO_URING
+  struct rhe_uring *ring = _uring_current();
+  if ( ring != NULL ) {
+    while ( (rv = _uring_send(ring, fileno, timeout, iovec, iovcnt_len, more)) < 0 && errno == EINTR ) {
+      rb_thread_check_ints();
+    }
+    if ( rv >= 0 || errno != EBUSY ) {
+      return rv;
+    }
+  }
+#endif
+  if ( do_select == 1) goto WAIT_WRITE;
+ DO_WRITE:
+#ifdef MSG_MORE
+  if ( more ) {
+    /* more data follows. let kernel merge it into same segments */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iovec;
+    msg.msg_iovlen = iovcnt_len;
+    rv = sendmsg(fileno, &msg, MSG_MORE);
+  }
+  else {
+    rv = writev(fileno, iovec, iovcnt_len);
+  }
+#else
+  rv = writev(fileno, iovec, iovcnt_len);
+#endif
+  if ( rv >= 0 ) {
+    return rv;
+  }
+  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
+    return rv;
+  }
+ WAIT_WRITE:
+  while (1) {
+    nfound = _poll_fd(fileno, POLLOUT, timeout);
+    if ( nfound == 1 ) {
+      break;
+    }
+    if ( nfound == 0 && errno != EINTR ) {
+      return -1;
+    }
+  }
+  goto DO_WRITE;
+}
+
+/* writes all iovecs, IOV_MAX at a time. returns bytes written or -1 */
+static
+ssize_t _writev_all(const int fileno, const double timeout, struct iovec *v, const long iovcnt, const int more) {
+  ssize_t rv;
+  ssize_t written = 0;
+  long vec_offset = 0;
+  long count;
+  while ( vec_offset < iovcnt ) {
+    count = iovcnt - vec_offset;
+    if ( count > IOV_MAX ) {
+      count = IOV_MAX;
+    }
+    rv = _writev_timeout(fileno, timeout, &v[vec_offset], count, (written == 0) ? 0 : 1, more);
+    if ( rv <= 0 ) {
+      // error or disconnected
+      return -1;
+    }
+    written += rv;
+    while ( rv > 0 ) {
+      if ( (size_t)rv >= v[vec_offset].iov_len ) {
+        rv -= v[vec_offset].iov_len;
+        vec_offset++;
+      }
+      else {
+        v[vec_offset].iov_base = (char*)v[vec_offset].iov_base + rv;
+        v[vec_offset].iov_len -= rv;
+        rv = 0;
+      }
+    }
+    /* skip empty iovecs left after a complete write */
+    while ( vec_offset < iovcnt && v[vec_offset].iov_len == 0 ) {
+      vec_offset++;
+    }
+  }
+  return written;
+}
+
+static
+ssize_t _read_timeout(const int fileno, const double timeout, char * read_buf, const ssize_t read_len ) {
+  ssize_t rv;
+  int nfound;
+#ifdef USE_IO_URING
+  struct rhe_uring *ring = _uring_current();
+  if ( ring != NULL ) {
+    while ( (rv = _uring_recv(ring, fileno, timeout, read_buf, read_len)) < 0 && errno == EINTR ) {
+      rb_thread_check_ints();
+    }
+    if ( rv >= 0 || errno != EBUSY ) {
+      return rv;
+    }
+  }
+#endif
+ DO_READ:
+  //rv = read(fileno, read_buf, read_len);
+  rv = recvfrom(fileno, read_buf, read_len, 0, NULL, NULL);
+  if ( rv >= 0 ) {
+    return rv;
+  }
+  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
+    return rv;
+  }
+  while (1) {
+    nfound = _poll_fd(fileno, POLLIN, timeout);
+    if ( nfound == 1 ) {
+      break;
+    }
+    if ( nfound == 0 && errno != EINTR ) {
+      return -1;
+    }
+  }
+  goto DO_READ;
+}
+
+static
+ssize_t _write_timeout(const int fileno, const double timeout, const char * write_buf, const long write_len ) {
+  ssize_t rv;
+  int nfound;
+  size_t write_buf_len;
+  if ( write_len < 0 ) {
+      return -1;
+  }
+  if ( write_len > UINT_MAX ) {
+      write_buf_len = UINT_MAX;
+  }
+  else {
+      write_buf_len = (unsigned int)write_len;
+  }
+#ifdef USE_IO_URING
+  struct rhe_uring *ring = _uring_current();
+  if ( ring != NULL ) {
+    struct iovec v;
+    v.iov_base = (char *)write_buf;
+    v.iov_len = write_buf_len;
+    while ( (rv = _uring_send(ring, fileno, timeout, &v, 1, 0)) < 0 && errno == EINTR ) {
+      rb_thread_check_ints();
+    }
+    if ( rv >= 0 || errno != EBUSY ) {
+      return rv;
+    }
+  }
+#endif
+  
+ DO_WRITE:
+  rv = write(fileno, write_buf, write_buf_len);
+  if ( rv >= 0 ) {
+    return rv;
+  }
+  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
+    return rv;
+  }
+  while (1) {
+    nfound = _poll_fd(fileno, POLLOUT, timeout);
+    if ( nfound == 1 ) {
+      break;
+    }
+    if ( nfound == 0 && errno != EINTR ) {
+      return -1;
+    }
+  }
+  goto DO_WRITE;
+}
+
+static
+ssize_t _sendfile_timeout(const int fileno, const double timeout, const int file_fd, off_t * offset, const size_t len) {
+  ssize_t rv;
+#ifdef HAVE_SYS_SENDFILE_H
+  int nfound;
+ DO_WRITE:
+  rv = sendfile(fileno, file_fd, offset, len);
+  if ( rv >= 0 ) {
+    return rv;
+  }
+  if ( rv < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
+    return rv;
+  }
+  while (1) {
+    nfound = _poll_fd(fileno, POLLOUT, timeout);
+    if ( nfound == 1 ) {
+      break;
+    }
+    if ( nfound == 0 && errno != EINTR ) {
+      return -1;
+    }
+  }
+  goto DO_WRITE;
+#else
+  char buf[READ_BUF];
+  rv = pread(file_fd, buf, (len > READ_BUF) ? READ_BUF : len, *offset);
+  if ( rv <= 0 ) {
+    return rv;
+  }
+  rv = _write_timeout(fileno, timeout, buf, rv);
+  if ( rv > 0 ) {
+    *offset += rv;
+  }
+  return rv;
+#endif
+}
+
+static
+void str_s(char * dst, int *dst_len, const char * src, const unsigned long src_len) {
+  unsigned long i;
+  int dlen = *dst_len;
+  for ( i=0; i<src_len; i++) {
+    dst[dlen++] = src[i];
+  }
+  *dst_len = dlen;
+}
+
+static
+void str_i(char * dst, int * dst_len, int src, int fig) {
+  int dlen = *dst_len + fig - 1;
+  do {
+    dst[dlen] = '0' + (src % 10);
+    dlen--;
+    src /= 10;
+  } while( dlen >= *dst_len );
+  *dst_len += fig;
+}
+
+static char status_lines[STATUS_LINE_MAX - STATUS_LINE_MIN + 1][STATUS_LINE_LEN];
+static int status_line_lens[STATUS_LINE_MAX - STATUS_LINE_MIN + 1];
+
+/* "HTTP/1.1 200 OK\r\n". dst has 512 bytes */
+static
+int _status_line(char * dst, int status_code) {
+  int i = 0;
+  size_t mlen;
+  const char * message;
+  str_s(dst, &i, "HTTP/1.1 ", sizeof("HTTP/1.1 ") - 1);
+  str_i(dst, &i, status_code, 3);
+  dst[i++] = ' ';
+  message = status_message(status_code, &mlen);
+  str_s(dst, &i, message, mlen);
+  dst[i++] = 13;
+  dst[i++] = 10;
+  return i;
+}
+
+static
+void _init_status_lines(void) {
+  char line[512];
+  int code;
+  for ( code = STATUS_LINE_MIN; code <= STATUS_LINE_MAX; code++ ) {
+    status_line_lens[code - STATUS_LINE_MIN] = _status_line(line, code);
+    memcpy(status_lines[code - STATUS_LINE_MIN], line, status_line_lens[code - STATUS_LINE_MIN]);
+  }
+}
+
+static
+int _chunked_header(char *buf, ssize_t len) {
+    int dlen = 0, i;
+    ssize_t l = len;
+    while ( l > 0 ) {
+        dlen++;
+        l /= 16;
+    }
+    i = dlen;
+    buf[i++] = 13;
+    buf[i++] = 10;
     while ( len > 0 ) {
         buf[--dlen] = xdigit[len % 16];
         len /= 16;
     }
-    return i;
+    return i;
+}
+
+static
+char * _date_header(void) {
+  static time_t last;
+  struct tm gtm;
+  time_t lt;
+  int i = 0;
+  time(&lt);
+  if ( last == lt ) return date_buf;
+  last = lt;
+  gmtime_r(&lt, &gtm);
+  date_buf[i++] = 'D';
+  date_buf[i++] = 'a';
+  date_buf[i++] = 't';
+  date_buf[i++] = 'e';
+  date_buf[i++] = ':';
+  date_buf[i++] = ' ';
+  str_s(date_buf, &i, DoW[gtm.tm_wday], 3);
+  date_buf[i++] = ',';
+  date_buf[i++] = ' ';
+  str_i(date_buf, &i, gtm.tm_mday, 2);
+  date_buf[i++] = ' ';
+  str_s(date_buf, &i, MoY[gtm.tm_mon], 3);
+  date_buf[i++] = ' ';
+  str_i(date_buf, &i, gtm.tm_year + 1900, 4);
+  date_buf[i++] = ' ';
+  str_i(date_buf, &i, gtm.tm_hour,2);
+  date_buf[i++] = ':';
+  str_i(date_buf, &i, gtm.tm_min,2);
+  date_buf[i++] = ':';
+  str_i(date_buf, &i, gtm.tm_sec,2);
+  date_buf[i++] = ' ';
+  date_buf[i++] = 'G';
+  date_buf[i++] = 'M';
+  date_buf[i++] = 'T';
+  date_buf[i++] = 13;
+  date_buf[i++] = 10;
+  return date_buf;
+}
+
+/* scoreboard. one slot per worker in memory shared with the master and
+   other workers. updated with plain stores, no syscalls on request path */
+enum {
+  SB_OPEN = 0,
+  SB_IDLE,
+  SB_READING,
+  SB_APP,
+  SB_WRITING
+};
+
+#define SB_METHOD_LEN 16
+#define SB_PATH_LEN 112
+
+/* phases of request processing timed for metrics */
+enum {
+  PHASE_ACCEPT = 0,
+  PHASE_HEADER,
+  PHASE_BODY,
+  PHASE_APP,
+  PHASE_WRITE,
+  PHASE_GC,
+  PHASE_NUM
+};
+static const char * const phase_names[] = { "accept", "header", "body", "app", "write", "gc" };
+
+/* log-linear histogram. under 1024ns, then 4 buckets per power of two up to 2^36ns (68.7s), then overflow */
+#define HIST_MIN_BITS 10
+#define HIST_SUB_BITS 2
+#define HIST_OCTAVES 26
+#define HIST_BUCKETS (1 + (HIST_OCTAVES << HIST_SUB_BITS) + 1)
+
+struct histogram {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long sum_ns;
+  unsigned long long count;
+};
+
+struct scoreboard_slot {
+  /* odd while request fields are updated */
+  unsigned int seq;
+  int state;
+  pid_t pid;
+  unsigned long requests;
+  struct timespec started;
+  char method[SB_METHOD_LEN];
+  char path[SB_PATH_LEN];
+  /* kept across workers taking the slot, so counters never go back */
+  struct histogram phases[PHASE_NUM];
+};
+
+static struct scoreboard_slot * scoreboard = NULL;
+static long scoreboard_slots = 0;
+static struct scoreboard_slot * scoreboard_self = NULL;
+static int metrics_enabled = 0;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define SB_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define SB_CLOCK CLOCK_MONOTONIC
+#endif
+
+static inline
+void _sb_state(const int state) {
+  if ( scoreboard_self != NULL ) {
+    scoreboard_self->state = state;
+  }
+}
+
+/* request bytes arrived */
+static inline
+void _sb_reading(void) {
+  if ( scoreboard_self != NULL ) {
+    /* vDSO, no syscall */
+    clock_gettime(SB_CLOCK, &scoreboard_self->started);
+    scoreboard_self->state = SB_READING;
+  }
+}
+
+static inline
+long long _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline
+void _hist_observe(const int phase, const long long ns) {
+  struct histogram *h;
+  int msb;
+  int idx;
+  if ( scoreboard_self == NULL ) {
+    return;
+  }
+  h = &scoreboard_self->phases[phase];
+  if ( ns < (1LL << HIST_MIN_BITS) ) {
+    idx = 0;
+  }
+  else {
+    msb = 63 - __builtin_clzll((unsigned long long)ns);
+    if ( msb - HIST_MIN_BITS >= HIST_OCTAVES ) {
+      idx = HIST_BUCKETS - 1;
+    }
+    else {
+      idx = 1 + ((msb - HIST_MIN_BITS) << HIST_SUB_BITS) +
+        (int)((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    }
+  }
+  h->counts[idx]++;
+  h->sum_ns += ns > 0 ? ns : 0;
+  h->count++;
+}
+
+/* phase ends now. returns now to start the next phase */
+static inline
+long long _phase_done(const int phase, long long * started) {
+  long long now = _now_ns();
+  if ( *started != 0 ) {
+    _hist_observe(phase, now - *started);
+    *started = 0;
+  }
+  return now;
+}
+
+/* response is written, including streamed body */
+static inline
+void _metrics_write_done(void) {
+  if ( metrics_enabled ) {
+    _phase_done(PHASE_WRITE, &_header_arena()->write_started);
+  }
+}
+
+/* request line is parsed. the app runs next */
+static inline
+void _sb_request(const char * method, size_t method_len, const char * path, size_t path_len) {
+  struct scoreboard_slot *sb = scoreboard_self;
+  if ( sb == NULL ) {
+    return;
+  }
+  if ( method_len > SB_METHOD_LEN - 1 ) {
+    method_len = SB_METHOD_LEN - 1;
+  }
+  if ( path_len > SB_PATH_LEN - 1 ) {
+    path_len = SB_PATH_LEN - 1;
+  }
+  __atomic_add_fetch(&sb->seq, 1, __ATOMIC_RELEASE);
+  memcpy(sb->method, method, method_len);
+  sb->method[method_len] = 0;
+  memcpy(sb->path, path, path_len);
+  sb->path[path_len] = 0;
+  sb->requests++;
+  sb->state = SB_APP;
+  __atomic_add_fetch(&sb->seq, 1, __ATOMIC_RELEASE);
+}
+
+/* LazyEnv keeps a copy of the header block, as the read buffer is reused,
+   and builds an HTTP_* String only when the app first reads the key through
+   the env default_proc. names are stored normalized, without HTTP_ */
+struct lazy_header {
+  long name_off;  /* -1 for continuing lines of the previous header */
+  long name_len;
+  long value_off;
+  long value_len;
+  int done;
+};
+
+struct lazy_headers {
+  char * buf;
+  int num;
+  int pending;
+  struct lazy_header headers[1];
+};
+
+static
+void _lazy_headers_free(void *ptr) {
+  xfree(ptr);
+}
+
+static
+size_t _lazy_headers_memsize(const void *ptr) {
+  const struct lazy_headers *lh = (const struct lazy_headers *)ptr;
+  return sizeof(*lh) + lh->num * sizeof(struct lazy_header) + lh->headers[lh->num].value_off;
+}
+
+static const rb_data_type_t lazy_headers_type = {
+  "rhebok_lazy_headers",
+  { NULL, _lazy_headers_free, _lazy_headers_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* deferred headers are headers[idx[0..num-1]]. one allocation holds the
+   entries and the copy of buf */
+static
+VALUE _lazy_headers_new(const char *buf, size_t buf_len, const struct phr_header *headers, const int *idx, int num) {
+  struct lazy_headers *lh;
+  struct lazy_header *h;
+  size_t entries = sizeof(*lh) + num * sizeof(struct lazy_header);
+  VALUE obj;
+  int i;
+
+  lh = (struct lazy_headers *)xmalloc(entries + buf_len);
+  lh->buf = (char *)lh + entries;
+  memcpy(lh->buf, buf, buf_len);
+  lh->num = num;
+  lh->pending = 0;
+  for ( i = 0; i < num; i++ ) {
+    h = &lh->headers[i];
+    if ( headers[idx[i]].name != NULL ) {
+      h->name_off = headers[idx[i]].name - buf;
+      h->name_len = headers[idx[i]].name_len;
+      header_key(lh->buf + h->name_off, lh->buf + h->name_off, h->name_len);
+      lh->pending++;
+    } else {
+      h->name_off = -1;
+      h->name_len = 0;
+    }
+    h->value_off = headers[idx[i]].value - buf;
+    h->value_len = headers[idx[i]].value_len;
+    h->done = 0;
+  }
+  /* sentinel for memsize */
+  lh->headers[num].value_off = buf_len;
+  obj = TypedData_Wrap_Struct(rb_cObject, &lazy_headers_type, lh);
+  return obj;
+}
+
+static
+struct lazy_headers * _lazy_headers(VALUE env) {
+  VALUE obj = rb_attr_get(env, id_lazy_headers);
+  struct lazy_headers *lh;
+  if ( NIL_P(obj) ) {
+    return NULL;
+  }
+  TypedData_Get_Struct(obj, struct lazy_headers, &lazy_headers_type, lh);
+  if ( lh->pending == 0 ) {
+    return NULL;
+  }
+  return lh;
+}
+
+/* joins every deferred header named name (normalized) like the eager parser
+   does, and stores it unless env already has the key. returns the value
+   or Qundef */
+static
+VALUE _lazy_resolve(VALUE env, struct lazy_headers *lh, const char *name, long name_len, VALUE key) {
+  struct lazy_header *h;
+  VALUE val = Qundef;
+  VALUE cur;
+  int i;
+
+  for ( i = 0; i < lh->num; i++ ) {
+    h = &lh->headers[i];
+    if ( h->done || h->name_off < 0 || h->name_len != name_len ||
+         memcmp(lh->buf + h->name_off, name, name_len) != 0 ) {
+      continue;
+    }
+    h->done = 1;
+    lh->pending--;
+    if ( val == Qundef ) {
+      val = rb_str_new(lh->buf + h->value_off, h->value_len);
+      for ( ; i + 1 < lh->num && lh->headers[i+1].name_off < 0; i++ ) {
+        lh->headers[i+1].done = 1;
+        rb_str_cat(val, lh->buf + lh->headers[i+1].value_off, lh->headers[i+1].value_len);
+      }
+    } else {
+      rb_str_cat2(val, ", ");
+      rb_str_cat(val, lh->buf + h->value_off, h->value_len);
+    }
+  }
+  if ( val == Qundef ) {
+    return Qundef;
+  }
+  cur = rb_hash_lookup2(env, key, Qundef);
+  if ( cur != Qundef ) {
+    return cur;
+  }
+  rb_hash_aset(env, key, val);
+  return val;
+}
+
+/* default_proc of a LazyEnv env. builds the deferred header for key and
+   stores it in env, so the next read is a plain Hash lookup. nil when the
+   request has no such header or it was already built */
+static
+VALUE rhe_lazy_header(VALUE self, VALUE env, VALUE key) {
+  struct lazy_headers *lh;
+  VALUE val;
+  long key_len;
+
+  if ( !RB_TYPE_P(env, T_HASH) || !RB_TYPE_P(key, T_STRING) ) {
+    return Qnil;
+  }
+  key_len = RSTRING_LEN(key);
+  if ( key_len <= 5 || key_len - 5 > MAX_HEADER_NAME_LEN ||
+       memcmp(RSTRING_PTR(key), "HTTP_", 5) != 0 ) {
+    return Qnil;
+  }
+  lh = _lazy_headers(env);
+  if ( lh == NULL ) {
+    return Qnil;
+  }
+#ifdef HAVE_RB_INTERNED_STR
+  key = rb_interned_str(RSTRING_PTR(key), key_len);
+#endif
+  val = _lazy_resolve(env, lh, RSTRING_PTR(key) + 5, key_len - 5, key);
+  return val == Qundef ? Qnil : val;
+}
+
+/* builds every header not read yet into env. for code that reads the Hash
+   table directly, eg. {}.merge(env), each or keys, which never calls the
+   default_proc. returns env */
+static
+VALUE rhe_materialize_env(VALUE self, VALUE env) {
+  struct lazy_headers *lh = _lazy_headers(env);
+  struct lazy_header *h;
+  char tmp[MAX_HEADER_NAME_LEN + sizeof("HTTP_") - 1] = "HTTP_";
+  VALUE key;
+  int i;
+
+  if ( lh == NULL ) {
+    return env;
+  }
+  for ( i = 0; i < lh->num && lh->pending > 0; i++ ) {
+    h = &lh->headers[i];
+    if ( h->done || h->name_off < 0 ) {
+      continue;
+    }
+    memcpy(tmp + 5, lh->buf + h->name_off, h->name_len);
+#ifdef HAVE_RB_INTERNED_STR
+    key = rb_interned_str(tmp, h->name_len + 5);
+#else
+    key = rb_str_new(tmp, h->name_len + 5);
+#endif
+    _lazy_resolve(env, lh, lh->buf + h->name_off, h->name_len, key);
+  }
+  rb_ivar_set(env, id_lazy_headers, Qnil);
+  return env;
+}
+
+static
+VALUE rhe_set_lazy_env(VALUE self, VALUE flag) {
+  lazy_env = RTEST(flag) ? 1 : 0;
+  return flag;
+}
+
+static
+int _parse_http_request(char *buf, ssize_t buf_len, VALUE env) {
+  const char* method;
+  size_t method_len;
+  const char* path;
+  size_t path_len;
+  int minor_version;
+  struct phr_header headers[MAX_HEADERS];
+  size_t num_headers, question_at;
+  size_t i;
+  int ret;
+  int escaped = 0;
+  char tmp[MAX_HEADER_NAME_LEN + sizeof("HTTP_") - 1] = "HTTP_";
+  VALUE last_value;
+  VALUE path_info;
+  /* env pairs, stored by one bulk insert */
+  VALUE pairs[(MAX_HEADERS + 6) * 2];
+  long npairs = 0;
+  long header_pairs;
+  long j;
+  /* headers deferred by LazyEnv */
+  int lazy_idx[MAX_HEADERS];
+  int nlazy = 0;
+  int last_lazy = 0;
+
+  num_headers = MAX_HEADERS;
+  ret = phr_parse_request(buf, buf_len, &method, &method_len, &path,
+                          &path_len, &minor_version, headers, &num_headers, 0);
+  if (ret < 0)
+    goto done;
+  _sb_request(method, method_len, path, path_len);
+
+  pairs[npairs++] = request_method_key;
+  pairs[npairs++] = request_method_value(method, method_len);
+  pairs[npairs++] = request_uri_key;
+  pairs[npairs++] = rb_str_new(path, path_len);
+  pairs[npairs++] = script_name_key;
+  pairs[npairs++] = vacant_string_val;
+  pairs[npairs++] = server_protocol_key;
+  pairs[npairs++] = (minor_version == 1) ? http11_val : http10_val;
+
+  /* PATH_INFO QUERY_STRING */
+  /* strip off all text after # after storing request_uri */
+  question_at = path_scan(path, 0, path_len, &path_len, &escaped);
+  path_info = path_info_value(path, question_at, escaped);
+  if ( NIL_P(path_info) ) {
+    ret = -1;
+    goto done;
+  }
+  pairs[npairs++] = path_info_key;
+  pairs[npairs++] = path_info;
+  if (question_at != path_len) ++question_at;
+  pairs[npairs++] = query_string_key;
+  pairs[npairs++] = ( path_len == question_at ) ? vacant_string_val : rb_str_new(path + question_at, path_len - question_at);
+  last_value = Qnil;
+  header_pairs = npairs;
+
+  for (i = 0; i < num_headers; ++i) {
+    if (headers[i].name != NULL) {
+      const char* name;
+      size_t name_len;
+      VALUE slot;
+      VALUE env_key;
+      const struct common_header *common;
+      if (sizeof(tmp) - 5 < headers[i].name_len) {
+        ret = -1;
+        goto done;
+      }
+      header_key(tmp + 5, headers[i].name, headers[i].name_len);
+      common = find_common_header(tmp + 5, headers[i].name_len);
+      if ( lazy_env && (common == NULL || !common->eager) ) {
+        lazy_idx[nlazy++] = i;
+        last_lazy = 1;
+        last_value = Qnil;
+        continue;
+      }
+      last_lazy = 0;
+      env_key = common != NULL ? common->key : Qnil;
+      if ( NIL_P(env_key) ) {
+        name = tmp;
+        name_len = headers[i].name_len + 5;
+#ifdef HAVE_RB_INTERNED_STR
+        /* deduplicated frozen key. no allocation once interned */
+        env_key = rb_interned_str(name, name_len);
+#else
+        env_key = rb_str_new(name, name_len);
+#endif
+      }
+      slot = Qnil;
+      for ( j = header_pairs; j < npairs; j += 2 ) {
+#ifdef HAVE_RB_INTERNED_STR
+        /* same header name always has the same key object */
+        if ( pairs[j] == env_key ) {
+#else
+        if ( rb_str_equal(pairs[j], env_key) == Qtrue ) {
+#endif
+          slot = pairs[j+1];
+          break;
+        }
+      }
+      if ( !NIL_P(slot) ) {
+        rb_str_cat2(slot, ", ");
+        rb_str_cat(slot, headers[i].value, headers[i].value_len);
+      } else {
+        slot = rb_str_new(headers[i].value, headers[i].value_len);
+        pairs[npairs++] = env_key;
+        pairs[npairs++] = slot;
+        last_value = slot;
+      }
+    } else {
+      // continuing lines of a mulitiline header
+        if ( last_lazy )
+          lazy_idx[nlazy++] = i;
+        else if ( !NIL_P(last_value) )
+          rb_str_cat(last_value, headers[i].value, headers[i].value_len);
+    }
+  }
+  if ( nlazy > 0 ) {
+    rb_ivar_set(env, id_lazy_headers, _lazy_headers_new(buf, ret, headers, lazy_idx, nlazy));
+  }
+#ifdef HAVE_RB_HASH_BULK_INSERT
+  rb_hash_bulk_insert(npairs, pairs, env);
+#else
+  for ( j = 0; j < npairs; j += 2 ) {
+    rb_hash_aset(env, pairs[j], pairs[j+1]);
+  }
+#endif
+ done:
+  return ret;
+}
+
+
+
+static
+int _decode_hex(int ch) {
+  if ( '0' <= ch && ch <= '9' ) {
+    return ch - '0';
+  } else if ( 'A' <= ch && ch <= 'F' ) {
+    return ch - 'A' + 0xa;
+  } else if ( 'a' <= ch && ch <= 'f' ) {
+    return ch - 'a' + 0xa;
+  }
+  return -1;
+}
+
+/*
+ * decodes chunked data in place. decoded bytes are moved to the head of buf
+ * and *bufsz is set to their length. returns -2 if more data is required,
+ * -1 on error, or the number of bytes left after the chunked data (placed
+ * at buf + *bufsz) once the last chunk and the trailers were consumed
+ */
+static
+ssize_t _decode_chunked(struct chunked_decoder *decoder, char *buf, size_t *bufsz) {
+  size_t dst = 0, src = 0, bufsz_in = *bufsz;
+  ssize_t ret = -2;
+  int v;
+
+  while (1) {
+    switch (decoder->state) {
+    case CHUNKED_IN_CHUNK_SIZE:
+      for (;; ++src) {
+        if ( src == bufsz_in ) {
+          goto exit;
+        }
+        if ( (v = _decode_hex(buf[src])) == -1 ) {
+          if ( decoder->hex_count == 0 ) {
+            ret = -1;
+            goto exit;
+          }
+          break;
+        }
+        if ( decoder->hex_count == sizeof(size_t) * 2 ) {
+          ret = -1;
+          goto exit;
+        }
+        decoder->bytes_left_in_chunk = decoder->bytes_left_in_chunk * 16 + v;
+        ++decoder->hex_count;
+      }
+      decoder->hex_count = 0;
+      decoder->state = CHUNKED_IN_CHUNK_EXT;
+      /* fallthru */
+    case CHUNKED_IN_CHUNK_EXT:
+      /* chunk extensions are ignored */
+      for (;; ++src) {
+        if ( src == bufsz_in ) {
+          goto exit;
+        }
+        if ( buf[src] == '\n' ) {
+          break;
+        }
+      }
+      ++src;
+      if ( decoder->bytes_left_in_chunk == 0 ) {
+        decoder->state = CHUNKED_IN_TRAILERS_LINE_HEAD;
+        break;
+      }
+      decoder->state = CHUNKED_IN_CHUNK_DATA;
+      /* fallthru */
+    case CHUNKED_IN_CHUNK_DATA: {
+      size_t avail = bufsz_in - src;
+      if ( avail < decoder->bytes_left_in_chunk ) {
+        if ( dst != src ) {
+          memmove(buf + dst, buf + src, avail);
+        }
+        src += avail;
+        dst += avail;
+        decoder->bytes_left_in_chunk -= avail;
+        goto exit;
+      }
+      if ( dst != src ) {
+        memmove(buf + dst, buf + src, decoder->bytes_left_in_chunk);
+      }
+      src += decoder->bytes_left_in_chunk;
+      dst += decoder->bytes_left_in_chunk;
+      decoder->bytes_left_in_chunk = 0;
+      decoder->state = CHUNKED_IN_CHUNK_CRLF;
+    }
+      /* fallthru */
+    case CHUNKED_IN_CHUNK_CRLF:
+      for (;; ++src) {
+        if ( src == bufsz_in ) {
+          goto exit;
+        }
+        if ( buf[src] != '\r' ) {
+          break;
+        }
+      }
+      if ( buf[src] != '\n' ) {
+        ret = -1;
+        goto exit;
+      }
+      ++src;
+      decoder->state = CHUNKED_IN_CHUNK_SIZE;
+      break;
+    case CHUNKED_IN_TRAILERS_LINE_HEAD:
+      for (;; ++src) {
+        if ( src == bufsz_in ) {
+          goto exit;
+        }
+        if ( buf[src] != '\r' ) {
+          break;
+        }
+      }
+      if ( buf[src++] == '\n' ) {
+        goto complete;
+      }
+      decoder->state = CHUNKED_IN_TRAILERS_LINE_MIDDLE;
+      /* fallthru */
+    case CHUNKED_IN_TRAILERS_LINE_MIDDLE:
+      /* trailers are ignored */
+      for (;; ++src) {
+        if ( src == bufsz_in ) {
+          goto exit;
+        }
+        if ( buf[src] == '\n' ) {
+          break;
+        }
+      }
+      ++src;
+      decoder->state = CHUNKED_IN_TRAILERS_LINE_HEAD;
+      break;
+    }
+  }
+
+ complete:
+  ret = bufsz_in - src;
+ exit:
+  if ( dst != src && ret >= 0 ) {
+    memmove(buf + dst, buf + src, bufsz_in - src);
+  }
+  *bufsz = dst;
+  return ret;
+}
+
+static
+ssize_t _read_request(const int fd, const double timeout, char * read_buf, const long read_buf_size, ssize_t * buf_lenp, VALUE env) {
+  ssize_t rv = 0;
+  ssize_t reqlen;
+  ssize_t buf_len = *buf_lenp;
+  VALUE expect_val;
+
+  while (1) {
+    reqlen = _parse_http_request(&read_buf[0],buf_len,env);
+    if ( reqlen >= 0 ) {
+      break;
+    }
+    else if ( reqlen == -1 ) {
+      /* error */
+      return -1;
+    }
+    if ( read_buf_size - buf_len == 0 ) {
+      /* too large header  */
+     char* badreq;
+     badreq = BAD_REQUEST;
+     rv = _write_timeout(fd, timeout, badreq, sizeof(BAD_REQUEST) - 1);
+     return -1;
+    }
+    /* request is incomplete */
+    rv = _read_timeout(fd, timeout, &read_buf[buf_len], read_buf_size - buf_len);
+    if ( rv <= 0 ) {
+      return -1;
+    }
+    buf_len += rv;
+  }
+  *buf_lenp = buf_len;
+
+  expect_val = rb_hash_aref(env, expect_key);
+  if ( !NIL_P(expect_val) ) {
+      if ( strncmp(RSTRING_PTR(expect_val), "100-continue", RSTRING_LEN(expect_val)) == 0 ) {
+          rv = _write_timeout(fd, timeout, EXPECT_CONTINUE, sizeof(EXPECT_CONTINUE) - 1);
+          if ( rv <= 0 ) {
+              return -1;
+          }
+      } else {
+          rv = _write_timeout(fd, timeout, EXPECT_FAILED, sizeof(EXPECT_FAILED) - 1);
+          return -1;
+      }
+  }
+  return reqlen;
+}
+
+static
+int _env_template_i(VALUE key, VALUE val, VALUE env) {
+  rb_hash_aset(env, key, val);
+  return ST_CONTINUE;
+}
+
+static
+VALUE _new_env(VALUE env_template) {
+  VALUE env;
+  /* room for the template and a typical request without rehash */
+#ifdef HAVE_RB_HASH_NEW_CAPA
+  env = rb_hash_new_capa(RHASH_SIZE(env_template) + 32);
+#else
+  env = rb_hash_new();
+#endif
+  rb_hash_foreach(env_template, _env_template_i, env);
+  return env;
+}
+
+static
+VALUE rhe_accept(VALUE self, VALUE fileno, VALUE timeoutv, VALUE tcp, VALUE env_template) {
+  struct sockaddr_in cliaddr;
+  unsigned int len;
+  long read_buf_size;
+  char * read_buf = _header_buf(&read_buf_size);
+  VALUE req;
+  VALUE env;
+  int flag = 1;
+  ssize_t rv = 0;
+  ssize_t buf_len;
+  ssize_t reqlen;
+  int fd;
+  double timeout = NUM2DBL(timeoutv);
+  struct header_arena *arena = NULL;
+  long long header_started = 0;
+
+  len = sizeof(cliaddr);
+  _sb_state(SB_IDLE);
+  if ( metrics_enabled ) {
+    arena = _header_arena();
+    if ( arena->accept_started == 0 ) {
+      /* accept returns every second without connection. wait spans the calls */
+      arena->accept_started = _now_ns();
+    }
+  }
+  fd = _accept(NUM2INT(fileno), (struct sockaddr *)&cliaddr, len);
+
+  /* endif */
+  if (fd < 0) {
+    goto badexit;
+  }
+  if ( metrics_enabled ) {
+    header_started = _phase_done(PHASE_ACCEPT, &arena->accept_started);
+  }
+
+  rv = _read_timeout(fd, timeout, &read_buf[0], read_buf_size);
+  if ( rv <= 0 ) {
+    close(fd);
+    goto badexit;
+  }
+  _sb_reading();
+
+  env = _new_env(env_template);
+  if ( tcp == Qtrue ) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(int));
+    rb_hash_aset(env, remote_addr_key, rb_str_new2(inet_ntoa(cliaddr.sin_addr)));
+    rb_hash_aset(env, remote_port_key, rb_fix2str(INT2FIX(ntohs(cliaddr.sin_port)),10));
+  }
+  else {
+    rb_hash_aset(env, remote_addr_key, vacant_string_val);
+    rb_hash_aset(env, remote_port_key, zero_string_val);
+  }
+
+  buf_len = rv;
+  reqlen = _read_request(fd, timeout, &read_buf[0], read_buf_size, &buf_len, env);
+  if ( reqlen < 0 ) {
+    close(fd);
+    goto badexit;
+  }
+  if ( metrics_enabled ) {
+    arena->app_started = _phase_done(PHASE_HEADER, &header_started);
+  }
+
+  req = rb_ary_new2(3);
+  rb_ary_push(req, INT2NUM(fd));
+  rb_ary_push(req, rb_str_new(&read_buf[reqlen],buf_len - reqlen));
+  rb_ary_push(req, env);
+  return req;
+ badexit:
+  return Qnil;
+}
+
+/* read next request on a keep-alive connection. bufv holds pipelined bytes */
+static
+VALUE rhe_read_rack(VALUE self, VALUE filenov, VALUE bufv, VALUE idle_timeoutv, VALUE timeoutv, VALUE env_template, VALUE remote_addr, VALUE remote_port) {
+  long read_buf_size;
+  char * read_buf = _header_buf(&read_buf_size);
+  VALUE req;
+  VALUE env;
+  ssize_t rv = 0;
+  ssize_t buf_len;
+  ssize_t reqlen;
+  int fd = NUM2INT(filenov);
+  double timeout = NUM2DBL(timeoutv);
+  long long header_started = 0;
+
+  _metrics_write_done();
+  buf_len = RSTRING_LEN(bufv);
+  if ( buf_len > read_buf_size ) {
+    return Qnil;
+  }
+  memcpy(&read_buf[0], RSTRING_PTR(bufv), buf_len);
+
+  if ( buf_len == 0 ) {
+    /* idle. give up on timeout, disconnect or signal */
+    _sb_state(SB_IDLE);
+    if ( _poll_fd(fd, POLLIN, NUM2DBL(idle_timeoutv)) != 1 ) {
+      return Qnil;
+    }
+    rv = _read_timeout(fd, timeout, &read_buf[0], read_buf_size);
+    if ( rv <= 0 ) {
+      return Qnil;
+    }
+    buf_len = rv;
+  }
+  _sb_reading();
+  if ( metrics_enabled ) {
+    header_started = _now_ns();
+  }
+
+  env = _new_env(env_template);
+  rb_hash_aset(env, remote_addr_key, remote_addr);
+  rb_hash_aset(env, remote_port_key, remote_port);
+  reqlen = _read_request(fd, timeout, &read_buf[0], read_buf_size, &buf_len, env);
+  if ( reqlen < 0 ) {
+    return Qnil;
+  }
+  if ( metrics_enabled ) {
+    _header_arena()->app_started = _phase_done(PHASE_HEADER, &header_started);
+  }
+  req = rb_ary_new2(2);
+  rb_ary_push(req, rb_str_new(&read_buf[reqlen],buf_len - reqlen));
+  rb_ary_push(req, env);
+  return req;
+}
+
+/* size of the buffer which request header must fit in */
+static
+VALUE rhe_set_max_header_size(VALUE self, VALUE sizev) {
+  long size = NUM2LONG(sizev);
+  if ( size <= 0 ) {
+    rb_raise(rb_eArgError, "max header size must be positive");
+  }
+  /* buffers are resized on next use */
+  header_buf_size = size;
+  return sizev;
+}
+
+/* wait for connections with EPOLLEXCLUSIVE. listener must be nonblocking */
+static
+VALUE rhe_set_exclusive_accept(VALUE self, VALUE flag) {
+#ifdef USE_EXCLUSIVE_ACCEPT
+  exclusive_accept = RTEST(flag) ? 1 : 0;
+#else
+  if ( RTEST(flag) ) {
+    rb_raise(rb_eNotImpError, "exclusive accept is not supported on this platform");
+  }
+#endif
+  return flag;
+}
+
+/* CPUs the process is allowed to run on */
+static
+VALUE rhe_cpu_affinity(VALUE self) {
+  VALUE cpus = rb_ary_new();
+#ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t set;
+  int i;
+  CPU_ZERO(&set);
+  if ( sched_getaffinity(0, sizeof(set), &set) < 0 ) {
+    rb_sys_fail("sched_getaffinity");
+  }
+  for ( i = 0; i < CPU_SETSIZE; i++ ) {
+    if ( CPU_ISSET(i, &set) ) {
+      rb_ary_push(cpus, INT2FIX(i));
+    }
+  }
+#endif
+  return cpus;
+}
+
+/* pin the process to given CPUs */
+static
+VALUE rhe_set_cpu_affinity(VALUE self, VALUE cpus) {
+#ifdef HAVE_SCHED_SETAFFINITY
+  cpu_set_t set;
+  long i;
+  int cpu;
+  Check_Type(cpus, T_ARRAY);
+  CPU_ZERO(&set);
+  for ( i = 0; i < RARRAY_LEN(cpus); i++ ) {
+    cpu = NUM2INT(rb_ary_entry(cpus, i));
+    if ( cpu < 0 || cpu >= CPU_SETSIZE ) {
+      rb_raise(rb_eArgError, "invalid cpu number: %d", cpu);
+    }
+    CPU_SET(cpu, &set);
+  }
+  if ( sched_setaffinity(0, sizeof(set), &set) < 0 ) {
+    rb_sys_fail("sched_setaffinity");
+  }
+#else
+  rb_raise(rb_eNotImpError, "cpu affinity is not supported on this platform");
+#endif
+  return cpus;
+}
+
+/* allocate memory from the NUMA node first */
+static
+VALUE rhe_set_numa_preferred_node(VALUE self, VALUE nodev) {
+#if defined(HAVE_LINUX_MEMPOLICY_H) && defined(__NR_set_mempolicy)
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+  int node = NUM2INT(nodev);
+  if ( node < 0 || node >= 1024 ) {
+    rb_raise(rb_eArgError, "invalid node number: %d", node);
+  }
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  /* kernel reads maxnode - 1 bits */
+  if ( syscall(__NR_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1) < 0 ) {
+    rb_sys_fail("set_mempolicy");
+  }
+#else
+  rb_raise(rb_eNotImpError, "NUMA memory policy is not supported on this platform");
+#endif
+  return nodev;
+}
+
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+/* pending connections and backlog of a listening unix socket by sock_diag */
+static
+VALUE _unix_listen_queue(int fd) {
+  struct {
+    struct nlmsghdr nlh;
+    struct unix_diag_req req;
+  } msg;
+  char buf[1024];
+  struct stat st;
+  struct nlmsghdr *h;
+  struct rtattr *attr;
+  struct unix_diag_rqlen *rqlen;
+  VALUE queue = Qnil;
+  ssize_t rv;
+  int attr_len;
+  int nl;
+
+  if ( fstat(fd, &st) < 0 ) {
+    return Qnil;
+  }
+  nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+  if ( nl < 0 ) {
+    return Qnil;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.nlh.nlmsg_len = sizeof(msg);
+  msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  msg.nlh.nlmsg_flags = NLM_F_REQUEST;
+  msg.req.sdiag_family = AF_UNIX;
+  msg.req.udiag_states = -1;
+  msg.req.udiag_ino = st.st_ino;
+  msg.req.udiag_show = UDIAG_SHOW_RQLEN;
+  /* no cookie */
+  msg.req.udiag_cookie[0] = ~0U;
+  msg.req.udiag_cookie[1] = ~0U;
+  if ( send(nl, &msg, sizeof(msg), 0) < 0 || (rv = recv(nl, buf, sizeof(buf), 0)) < 0 ) {
+    close(nl);
+    return Qnil;
+  }
+  close(nl);
+  for ( h = (struct nlmsghdr *)buf; NLMSG_OK(h, rv); h = NLMSG_NEXT(h, rv) ) {
+    if ( h->nlmsg_type != SOCK_DIAG_BY_FAMILY ) {
+      break;
+    }
+    attr = (struct rtattr *)((struct unix_diag_msg *)NLMSG_DATA(h) + 1);
+    attr_len = h->nlmsg_len - NLMSG_LENGTH(sizeof(struct unix_diag_msg));
+    for ( ; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len) ) {
+      if ( attr->rta_type == UNIX_DIAG_RQLEN ) {
+        rqlen = (struct unix_diag_rqlen *)RTA_DATA(attr);
+        queue = rb_assoc_new(UINT2NUM(rqlen->udiag_rqueue), UINT2NUM(rqlen->udiag_wqueue));
+      }
+    }
+  }
+  return queue;
+}
+#endif
+
+/* [pending connections, backlog] of a listening socket. nil if not available */
+static
+VALUE rhe_listen_queue(VALUE self, VALUE filenov) {
+  int fd = NUM2INT(filenov);
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+#endif
+
+  if ( getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0 ) {
+    rb_sys_fail("getsockname");
+  }
+#if defined(__linux__) && defined(TCP_INFO)
+  /* unacked and sacked are the accept queue of a listening socket */
+  if ( addr.ss_family == AF_INET || addr.ss_family == AF_INET6 ) {
+    if ( getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 && info.tcpi_state == TCP_LISTEN ) {
+      return rb_assoc_new(UINT2NUM(info.tcpi_unacked), UINT2NUM(info.tcpi_sacked));
+    }
+    return Qnil;
+  }
+#endif
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+  if ( addr.ss_family == AF_UNIX ) {
+    return _unix_listen_queue(fd);
+  }
+#endif
+  return Qnil;
+}
+
+/* create scoreboard of given slots. must be called before workers are forked */
+static
+VALUE rhe_scoreboard_create(VALUE self, VALUE slotsv) {
+  long slots = NUM2LONG(slotsv);
+  void * p;
+  if ( slots <= 0 ) {
+    rb_raise(rb_eArgError, "scoreboard slots must be positive");
+  }
+  p = mmap(NULL, sizeof(struct scoreboard_slot) * slots, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if ( p == MAP_FAILED ) {
+    rb_sys_fail("mmap");
+  }
+  if ( scoreboard != NULL ) {
+    munmap(scoreboard, sizeof(struct scoreboard_slot) * scoreboard_slots);
+  }
+  scoreboard = (struct scoreboard_slot *)p;
+  scoreboard_slots = slots;
+  scoreboard_self = NULL;
+  return slotsv;
+}
+
+/* take the slot in a worker. nil releases it */
+static
+VALUE rhe_set_scoreboard_slot(VALUE self, VALUE slotv) {
+  struct scoreboard_slot *sb;
+  if ( scoreboard == NULL ) {
+    return slotv;
+  }
+  if ( NIL_P(slotv) ) {
+    if ( scoreboard_self != NULL ) {
+      scoreboard_self->state = SB_OPEN;
+      scoreboard_self->pid = 0;
+      scoreboard_self = NULL;
+    }
+    return slotv;
+  }
+  sb = &scoreboard[NUM2LONG(slotv) % scoreboard_slots];
+  __atomic_add_fetch(&sb->seq, 1, __ATOMIC_RELEASE);
+  sb->requests = 0;
+  sb->method[0] = 0;
+  sb->path[0] = 0;
+  clock_gettime(SB_CLOCK, &sb->started);
+  sb->state = SB_IDLE;
+  sb->pid = getpid();
+  __atomic_add_fetch(&sb->seq, 1, __ATOMIC_RELEASE);
+  scoreboard_self = sb;
+  return slotv;
 }
 
 static
-char * _date_header(void) {
-  static time_t last;
-  struct tm gtm;
-  time_t lt;
-  int i = 0;
-  time(&lt);
-  if ( last == lt ) return date_buf;
-  last = lt;
-  gmtime_r(&lt, &gtm);
-  date_buf[i++] = 'D';
-  date_buf[i++] = 'a';
-  date_buf[i++] = 't';
-  date_buf[i++] = 'e';
-  date_buf[i++] = ':';
-  date_buf[i++] = ' ';
-  str_s(date_buf, &i, DoW[gtm.tm_wday], 3);
-  date_buf[i++] = ',';
-  date_buf[i++] = ' ';
-  str_i(date_buf, &i, gtm.tm_mday, 2);
-  date_buf[i++] = ' ';
-  str_s(date_buf, &i, MoY[gtm.tm_mon], 3);
-  date_buf[i++] = ' ';
-  str_i(date_buf, &i, gtm.tm_year + 1900, 4);
-  date_buf[i++] = ' ';
-  str_i(date_buf, &i, gtm.tm_hour,2);
-  date_buf[i++] = ':';
-  str_i(date_buf, &i, gtm.tm_min,2);
-  date_buf[i++] = ':';
-  str_i(date_buf, &i, gtm.tm_sec,2);
-  date_buf[i++] = ' ';
-  date_buf[i++] = 'G';
-  date_buf[i++] = 'M';
-  date_buf[i++] = 'T';
-  date_buf[i++] = 13;
-  date_buf[i++] = 10;
-  return date_buf;
+long _proc_rss(pid_t pid) {
+  char path[64];
+  char buf[128];
+  long size, resident;
+  ssize_t rv;
+  int fd;
+  snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if ( fd < 0 ) {
+    return -1;
+  }
+  rv = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if ( rv <= 0 ) {
+    return -1;
+  }
+  buf[rv] = 0;
+  if ( sscanf(buf, "%ld %ld", &size, &resident) != 2 ) {
+    return -1;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* proportional set size. pages shared with the master and other workers are
+   divided by the number of processes sharing them */
+static
+long _proc_pss(pid_t pid) {
+  char path[64];
+  char buf[4096];
+  const char *p;
+  long pss;
+  ssize_t rv;
+  int fd;
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if ( fd < 0 ) {
+    return -1;
+  }
+  rv = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if ( rv <= 0 ) {
+    return -1;
+  }
+  buf[rv] = 0;
+  p = strstr(buf, "\nPss:");
+  if ( p == NULL || sscanf(p + 5, "%ld", &pss) != 1 ) {
+    return -1;
+  }
+  return pss * 1024;
+}
+
+/* RSS of a process in bytes from statm. nil if not available */
+static
+VALUE rhe_proc_rss(VALUE self, VALUE pidv) {
+  long rss = _proc_rss(NUM2INT(pidv));
+  return rss < 0 ? Qnil : LONG2NUM(rss);
+}
+
+/* PSS of a process in bytes. nil if not available. reading it walks the page
+   table of the process, so it is not a part of the scoreboard */
+static
+VALUE rhe_proc_pss(VALUE self, VALUE pidv) {
+  long pss = _proc_pss(NUM2INT(pidv));
+  return pss < 0 ? Qnil : LONG2NUM(pss);
+}
+
+/* snapshot of workers. RSS is read by the caller, so workers pay nothing for it */
+static
+VALUE rhe_scoreboard(VALUE self) {
+  static const char * const states[] = { "open", "idle", "reading", "app", "writing" };
+  struct scoreboard_slot snap;
+  struct timespec now;
+  VALUE workers = rb_ary_new();
+  VALUE worker;
+  unsigned int seq;
+  long i;
+  long rss;
+  int retry;
+
+  clock_gettime(SB_CLOCK, &now);
+  for ( i = 0; i < scoreboard_slots; i++ ) {
+    for ( retry = 0; retry < 100; retry++ ) {
+      seq = __atomic_load_n(&scoreboard[i].seq, __ATOMIC_ACQUIRE);
+      memcpy(&snap, &scoreboard[i], sizeof(snap));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if ( (seq & 1) == 0 && seq == __atomic_load_n(&scoreboard[i].seq, __ATOMIC_RELAXED) ) {
+        break;
+      }
+    }
+    if ( snap.pid == 0 || snap.state <= SB_OPEN || snap.state > SB_WRITING ) {
+      continue;
+    }
+    snap.method[SB_METHOD_LEN - 1] = 0;
+    snap.path[SB_PATH_LEN - 1] = 0;
+    rss = _proc_rss(snap.pid);
+    if ( rss < 0 ) {
+      /* killed before releasing the slot */
+      continue;
+    }
+    worker = rb_hash_new();
+    rb_hash_aset(worker, rb_str_new_cstr("slot"), LONG2NUM(i));
+    rb_hash_aset(worker, rb_str_new_cstr("pid"), INT2NUM(snap.pid));
+    rb_hash_aset(worker, rb_str_new_cstr("state"), rb_str_new_cstr(states[snap.state]));
+    rb_hash_aset(worker, rb_str_new_cstr("requests"), ULONG2NUM(snap.requests));
+    rb_hash_aset(worker, rb_str_new_cstr("elapsed"),
+                 DBL2NUM((now.tv_sec - snap.started.tv_sec) + (now.tv_nsec - snap.started.tv_nsec) / 1e9));
+    rb_hash_aset(worker, rb_str_new_cstr("method"), rb_str_new_cstr(snap.method));
+    rb_hash_aset(worker, rb_str_new_cstr("path"), rb_str_new_cstr(snap.path));
+    rb_hash_aset(worker, rb_str_new_cstr("rss"), LONG2NUM(rss));
+    rb_ary_push(workers, worker);
+  }
+  return workers;
+}
+
+/* time request phases into the scoreboard */
+static
+VALUE rhe_set_metrics(VALUE self, VALUE flag) {
+  metrics_enabled = RTEST(flag) ? 1 : 0;
+  return flag;
+}
+
+/* out of band GC, timed as gc phase. runs the block instead of GC.start if given */
+static
+VALUE rhe_oob_gc(VALUE self) {
+  long long started = metrics_enabled ? _now_ns() : 0;
+  VALUE disabled;
+  if ( rb_block_given_p() ) {
+    rb_yield(Qnil);
+  }
+  else {
+    disabled = rb_gc_enable();
+    rb_gc_start();
+    if ( RTEST(disabled) ) {
+      rb_gc_disable();
+    }
+  }
+  if ( metrics_enabled ) {
+    _phase_done(PHASE_GC, &started);
+  }
+  return Qnil;
+}
+
+/* adaptive out of band GC. collects when the heap has come OOB_GC_THRESHOLD
+   of the way to a GC the next request would trigger */
+#define OOB_GC_THRESHOLD 0.8
+
+static struct {
+  int ready;
+  int has_oldmalloc;
+  size_t gc_count;    /* GC.count at the last snapshot */
+  size_t live_after;  /* heap_live_slots after the last GC */
+  size_t free_after;  /* heap_free_slots after the last GC */
+  long long started;
+  long long gc_ns;
+} oob_gc;
+
+static VALUE sym_heap_live_slots;
+static VALUE sym_heap_free_slots;
+static VALUE sym_malloc_increase_bytes;
+static VALUE sym_malloc_increase_bytes_limit;
+static VALUE sym_old_objects;
+static VALUE sym_old_objects_limit;
+static VALUE sym_oldmalloc_increase_bytes;
+static VALUE sym_oldmalloc_increase_bytes_limit;
+static VALUE sym_minor;
+static VALUE sym_major;
+static VALUE sym_full_mark;
+static VALUE sym_immediate_sweep;
+
+static
+void _oob_gc_snapshot(void) {
+  oob_gc.gc_count = rb_gc_count();
+  oob_gc.live_after = rb_gc_stat(sym_heap_live_slots);
+  oob_gc.free_after = rb_gc_stat(sym_heap_free_slots);
+}
+
+/* Qnil, :minor or :major */
+static
+VALUE _oob_gc_kind(void) {
+  const double t = OOB_GC_THRESHOLD;
+  size_t live;
+  if ( rb_gc_stat(sym_old_objects) >= rb_gc_stat(sym_old_objects_limit) * t ) {
+    return sym_major;
+  }
+  if ( oob_gc.has_oldmalloc &&
+       rb_gc_stat(sym_oldmalloc_increase_bytes) >= rb_gc_stat(sym_oldmalloc_increase_bytes_limit) * t ) {
+    return sym_major;
+  }
+  if ( rb_gc_stat(sym_malloc_increase_bytes) >= rb_gc_stat(sym_malloc_increase_bytes_limit) * t ) {
+    return sym_minor;
+  }
+  live = rb_gc_stat(sym_heap_live_slots);
+  if ( live > oob_gc.live_after && live - oob_gc.live_after >= oob_gc.free_after * t ) {
+    return sym_minor;
+  }
+  return Qnil;
+}
+
+/* connections waiting in the backlog or taken by multishot accept */
+static
+int _oob_gc_busy(int fileno) {
+  struct pollfd fds[1];
+#ifdef USE_IO_URING
+  struct rhe_uring *ring = _uring_current();
+  if ( ring != NULL && ring->accepted_num > 0 ) {
+    return 1;
+  }
+#endif
+  fds[0].fd = fileno;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  return poll(fds, 1, 0) > 0;
+}
+
+/*
+ * Rhebok.adaptive_oob_gc(fileno, budget)
+ * runs GC if the heap needs it, nothing is pending on the listen socket and
+ * the worker spent less than budget (ratio of time) in this GC. returns the
+ * kind of GC or nil
+ */
+static
+VALUE rhe_adaptive_oob_gc(VALUE self, VALUE filenov, VALUE budgetv) {
+  int fileno = NUM2INT(filenov);
+  double budget = NUM2DBL(budgetv);
+  long long now = _now_ns();
+  long long started;
+  VALUE kind;
+  VALUE opts;
+  VALUE disabled;
+
+  if ( !oob_gc.ready ) {
+    oob_gc.ready = 1;
+    oob_gc.has_oldmalloc = !NIL_P(rb_hash_lookup2(rb_funcall(rb_mGC, rb_intern("stat"), 0),
+                                                  sym_oldmalloc_increase_bytes, Qnil));
+    oob_gc.started = now;
+    _oob_gc_snapshot();
+  }
+  else if ( rb_gc_count() != oob_gc.gc_count ) {
+    /* collected in a request */
+    _oob_gc_snapshot();
+  }
+  if ( budget > 0 && oob_gc.gc_ns > budget * (now - oob_gc.started) ) {
+    return Qnil;
+  }
+  kind = _oob_gc_kind();
+  if ( NIL_P(kind) || _oob_gc_busy(fileno) ) {
+    return Qnil;
+  }
+
+  started = now;
+  opts = rb_hash_new();
+  rb_hash_aset(opts, sym_full_mark, kind == sym_major ? Qtrue : Qfalse);
+  rb_hash_aset(opts, sym_immediate_sweep, Qtrue);
+  disabled = rb_gc_enable();
+  rb_funcallv_kw(rb_mGC, rb_intern("start"), 1, &opts, RB_PASS_KEYWORDS);
+  if ( RTEST(disabled) ) {
+    rb_gc_disable();
+  }
+  oob_gc.gc_ns += _now_ns() - started;
+  _oob_gc_snapshot();
+  if ( metrics_enabled ) {
+    _phase_done(PHASE_GC, &started);
+  }
+  return kind;
+}
+
+/* histograms of all slots. counts are per bucket, "le" is upper bound of each bucket in seconds */
+static
+VALUE rhe_metrics(VALUE self) {
+  VALUE metrics = rb_hash_new();
+  VALUE le = rb_ary_new2(HIST_BUCKETS);
+  VALUE phase;
+  VALUE counts;
+  unsigned long long sum, count, n;
+  long i;
+  int p, b;
+
+  rb_ary_push(le, DBL2NUM((double)(1LL << HIST_MIN_BITS) / 1e9));
+  for ( b = 1; b < HIST_BUCKETS - 1; b++ ) {
+    int octave = (b - 1) >> HIST_SUB_BITS;
+    int sub = (b - 1) & ((1 << HIST_SUB_BITS) - 1);
+    rb_ary_push(le, DBL2NUM((double)((1LL << (octave + HIST_MIN_BITS - HIST_SUB_BITS)) * ((1 << HIST_SUB_BITS) + sub + 1)) / 1e9));
+  }
+  rb_ary_push(le, DBL2NUM(HUGE_VAL));
+  rb_hash_aset(metrics, rb_str_new_cstr("le"), le);
+
+  for ( p = 0; p < PHASE_NUM; p++ ) {
+    counts = rb_ary_new2(HIST_BUCKETS);
+    for ( b = 0; b < HIST_BUCKETS; b++ ) {
+      n = 0;
+      for ( i = 0; i < scoreboard_slots; i++ ) {
+        n += scoreboard[i].phases[p].counts[b];
+      }
+      rb_ary_push(counts, ULL2NUM(n));
+    }
+    sum = 0;
+    count = 0;
+    for ( i = 0; i < scoreboard_slots; i++ ) {
+      sum += scoreboard[i].phases[p].sum_ns;
+      count += scoreboard[i].phases[p].count;
+    }
+    phase = rb_hash_new();
+    rb_hash_aset(phase, rb_str_new_cstr("counts"), counts);
+    rb_hash_aset(phase, rb_str_new_cstr("sum"), DBL2NUM((double)sum / 1e9));
+    rb_hash_aset(phase, rb_str_new_cstr("count"), ULL2NUM(count));
+    rb_hash_aset(metrics, rb_str_new_cstr(phase_names[p]), phase);
+  }
+  return metrics;
+}
+
+/* run accept, recv and send on io_uring of each thread */
+static
+VALUE rhe_set_io_uring(VALUE self, VALUE flag) {
+#ifdef USE_IO_URING
+  io_uring_enabled = RTEST(flag) ? 1 : 0;
+  if ( io_uring_enabled && _uring_current() == NULL ) {
+    io_uring_enabled = 0;
+    rb_raise(rb_eNotImpError, "io_uring is not available: %s", strerror(errno));
+  }
+#else
+  if ( RTEST(flag) ) {
+    rb_raise(rb_eNotImpError, "io_uring is not supported on this platform");
+  }
+#endif
+  return flag;
+}
+
+/* keep one accept request armed on the listener. turning off cancels it,
+   connections already accepted are left in queued_connections */
+static
+VALUE rhe_set_multishot_accept(VALUE self, VALUE flag) {
+#ifdef USE_IO_URING
+  struct rhe_uring *ring;
+  multishot_accept = RTEST(flag) ? 1 : 0;
+  if ( !multishot_accept && (ring = _uring_current()) != NULL ) {
+    _uring_stop_multishot(ring);
+  }
+#endif
+  return flag;
+}
+
+static
+VALUE rhe_queued_connections(VALUE self) {
+#ifdef USE_IO_URING
+  struct rhe_uring *ring = _uring_current();
+  if ( ring != NULL ) {
+    return LONG2NUM(ring->accepted_num);
+  }
+#endif
+  return INT2FIX(0);
+}
+
+static
+int _write_all_fd(const int fd, const char * buf, ssize_t len) {
+  ssize_t rv;
+  while ( len > 0 ) {
+    rv = write(fd, buf, len);
+    if ( rv < 0 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    buf += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+/* request body. the first memory_max bytes are kept in head, the rest is
+   written to an anonymous file and read back through a read-only mapping.
+   head is not copied to the file when the body grows over memory_max */
+struct spill_buffer {
+  int fd;
+  VALUE head;
+  long memory_max;
+  size_t length;  /* Content-Length, limits preallocation. 0 if unknown */
+  size_t file_size;
+  size_t reserved;
+  char *map;
+  size_t map_len;
+  size_t pos;
+  int closed;
+};
+
+static
+void _spill_mark(void *ptr) {
+  rb_gc_mark(((struct spill_buffer *)ptr)->head);
+}
+
+static
+void _spill_release(struct spill_buffer *sp) {
+  if ( sp->map != NULL ) {
+    munmap(sp->map, sp->map_len);
+    sp->map = NULL;
+    sp->map_len = 0;
+  }
+  if ( sp->fd >= 0 ) {
+    close(sp->fd);
+    sp->fd = -1;
+  }
+}
+
+static
+void _spill_free(void *ptr) {
+  _spill_release((struct spill_buffer *)ptr);
+  xfree(ptr);
+}
+
+static
+size_t _spill_memsize(const void *ptr) {
+  return sizeof(struct spill_buffer);
+}
+
+static const rb_data_type_t spill_type = {
+  "rhebok_spill_buffer",
+  { _spill_mark, _spill_free, _spill_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static
+VALUE _spill_alloc(VALUE klass) {
+  struct spill_buffer *sp;
+  VALUE obj = TypedData_Make_Struct(klass, struct spill_buffer, &spill_type, sp);
+  sp->fd = -1;
+  sp->head = Qnil;
+  return obj;
+}
+
+static
+struct spill_buffer * _spill(VALUE self) {
+  struct spill_buffer *sp;
+  TypedData_Get_Struct(self, struct spill_buffer, &spill_type, sp);
+  if ( NIL_P(sp->head) || sp->closed ) {
+    rb_raise(rb_eIOError, "closed body buffer");
+  }
+  return sp;
+}
+
+/* memfd, O_TMPFILE or unlinked mkstemp file in TMPDIR */
+static
+int _spill_fd(void) {
+  int fd;
+  const char *dir;
+  char path[PATH_MAX];
+  /* on disk first. memfd pages stay in memory */
+  dir = getenv("TMPDIR");
+  if ( dir == NULL || *dir == '\0' ) {
+    dir = "/tmp";
+  }
+#ifdef O_TMPFILE
+  fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if ( fd >= 0 ) {
+    return fd;
+  }
+#endif
+  if ( snprintf(path, sizeof(path), "%s/rhebok-body-XXXXXX", dir) < (int)sizeof(path) ) {
+    fd = mkstemp(path);
+    if ( fd >= 0 ) {
+      unlink(path);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      return fd;
+    }
+  }
+#ifdef HAVE_MEMFD_CREATE
+  /* TMPDIR is not writable */
+  fd = memfd_create("rhebok-body", MFD_CLOEXEC);
+  if ( fd >= 0 ) {
+    return fd;
+  }
+#endif
+  return -1;
+}
+
+static
+void _spill_open(struct spill_buffer *sp) {
+  sp->fd = _spill_fd();
+  if ( sp->fd < 0 ) {
+    rb_sys_fail("spill file");
+  }
+}
+
+static
+int _spill_write(struct spill_buffer *sp, const char *buf, long len) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  size_t reserve;
+#endif
+  if ( sp->fd < 0 && RSTRING_LEN(sp->head) + len <= sp->memory_max ) {
+    rb_str_cat(sp->head, buf, len);
+    return 0;
+  }
+  if ( sp->fd < 0 ) {
+    _spill_open(sp);
+  }
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  /* reserve blocks a step ahead of the received bytes, not for the claimed
+     Content-Length. not supported everywhere */
+  if ( sp->file_size + len > sp->reserved ) {
+    reserve = sp->file_size + len + SPILL_RESERVE_STEP;
+    if ( sp->length > (size_t)RSTRING_LEN(sp->head) && reserve > sp->length - RSTRING_LEN(sp->head) ) {
+      reserve = sp->length - RSTRING_LEN(sp->head);
+    }
+    if ( reserve > sp->reserved ) {
+      fallocate(sp->fd, FALLOC_FL_KEEP_SIZE, sp->reserved, reserve - sp->reserved);
+      sp->reserved = reserve;
+    }
+  }
+#endif
+  if ( _write_all_fd(sp->fd, buf, len) < 0 ) {
+    return -1;
+  }
+  sp->file_size += len;
+  return 0;
+}
+
+/* maps bytes written to the file */
+static
+void _spill_map(struct spill_buffer *sp) {
+  char *map;
+  if ( sp->map_len == sp->file_size ) {
+    return;
+  }
+  map = mmap(NULL, sp->file_size, PROT_READ, MAP_SHARED, sp->fd, 0);
+  if ( map == MAP_FAILED ) {
+    rb_sys_fail("mmap spill file");
+  }
+  if ( sp->map != NULL ) {
+    munmap(sp->map, sp->map_len);
+  }
+  sp->map = map;
+  sp->map_len = sp->file_size;
+}
+
+/* contiguous bytes from pos */
+static
+long _spill_peek(struct spill_buffer *sp, const char **ptr) {
+  size_t head_len = RSTRING_LEN(sp->head);
+  if ( sp->pos < head_len ) {
+    *ptr = RSTRING_PTR(sp->head) + sp->pos;
+    return head_len - sp->pos;
+  }
+  _spill_map(sp);
+  *ptr = sp->map + (sp->pos - head_len);
+  return sp->map_len - (sp->pos - head_len);
+}
+
+static
+size_t _spill_size(struct spill_buffer *sp) {
+  return RSTRING_LEN(sp->head) + sp->file_size;
+}
+
+/*
+ * Rhebok::SpillBuffer.new(length, memory_max)
+ * length is Content-Length or 0 if unknown
+ */
+static
+VALUE rhe_spill_initialize(VALUE self, VALUE lengthv, VALUE memory_maxv) {
+  struct spill_buffer *sp;
+  TypedData_Get_Struct(self, struct spill_buffer, &spill_type, sp);
+  sp->length = NUM2SIZET(lengthv);
+  sp->memory_max = NUM2LONG(memory_maxv);
+  sp->head = rb_str_buf_new(sp->length <= (size_t)sp->memory_max ? (long)sp->length : 0);
+  if ( sp->length > (size_t)sp->memory_max ) {
+    _spill_open(sp);
+  }
+  return self;
+}
+
+static
+VALUE rhe_spill_print(VALUE self, VALUE buf) {
+  struct spill_buffer *sp = _spill(self);
+  StringValue(buf);
+  if ( _spill_write(sp, RSTRING_PTR(buf), RSTRING_LEN(buf)) < 0 ) {
+    rb_sys_fail("write spill file");
+  }
+  return Qnil;
+}
+
+static
+VALUE rhe_spill_size(VALUE self) {
+  return SIZET2NUM(_spill_size(_spill(self)));
+}
+
+static
+VALUE rhe_spill_spilled_p(VALUE self) {
+  return _spill(self)->fd >= 0 ? Qtrue : Qfalse;
+}
+
+static
+VALUE rhe_spill_rewind(VALUE self) {
+  _spill(self)->pos = 0;
+  return self;
+}
+
+/* read([length[, outbuf]]) */
+static
+VALUE rhe_spill_read(int argc, VALUE *argv, VALUE self) {
+  struct spill_buffer *sp = _spill(self);
+  VALUE lengthv, outbuf;
+  const char *ptr;
+  long length, avail, n;
+
+  rb_scan_args(argc, argv, "02", &lengthv, &outbuf);
+  avail = _spill_size(sp) - sp->pos;
+  if ( NIL_P(lengthv) ) {
+    length = avail;
+  }
+  else {
+    length = NUM2LONG(lengthv);
+    if ( length < 0 ) {
+      rb_raise(rb_eArgError, "negative length %ld given", length);
+    }
+    if ( avail == 0 && length > 0 ) {
+      if ( !NIL_P(outbuf) ) {
+        rb_str_resize(StringValue(outbuf), 0);
+      }
+      return Qnil;
+    }
+    if ( length > avail ) {
+      length = avail;
+    }
+  }
+  if ( NIL_P(outbuf) ) {
+    outbuf = rb_str_buf_new(length);
+  }
+  else {
+    StringValue(outbuf);
+    rb_str_resize(outbuf, 0);
+    rb_str_modify_expand(outbuf, length);
+  }
+  while ( length > 0 ) {
+    n = _spill_peek(sp, &ptr);
+    if ( n > length ) {
+      n = length;
+    }
+    rb_str_cat(outbuf, ptr, n);
+    sp->pos += n;
+    length -= n;
+  }
+  return outbuf;
 }
 
 static
-int _parse_http_request(char *buf, ssize_t buf_len, VALUE env) {
-  const char* method;
-  size_t method_len;
-  const char* path;
-  size_t path_len;
-  int minor_version;
-  struct phr_header headers[MAX_HEADERS];
-  size_t num_headers, question_at;
-  size_t i;
-  int ret;
-  char tmp[MAX_HEADER_NAME_LEN + sizeof("HTTP_") - 1] = "HTTP_";
-  VALUE last_value;
-
-  num_headers = MAX_HEADERS;
-  ret = phr_parse_request(buf, buf_len, &method, &method_len, &path,
-                          &path_len, &minor_version, headers, &num_headers, 0);
-  if (ret < 0)
-    goto done;
+VALUE rhe_spill_gets(VALUE self) {
+  struct spill_buffer *sp = _spill(self);
+  VALUE line = Qnil;
+  const char *ptr, *lf;
+  long n;
 
-  rb_hash_aset(env, request_method_key, rb_str_new(method,method_len));
-  rb_hash_aset(env, request_uri_key, rb_str_new(path, path_len));
-  rb_hash_aset(env, script_name_key, vacant_string_val);
-  rb_hash_aset(env, server_protocol_key, (minor_version == 1) ? http11_val : http10_val);
-
-  /* PATH_INFO QUERY_STRING */
-  path_len = find_ch(path, path_len, '#'); /* strip off all text after # after storing request_uri */
-  question_at = find_ch(path, path_len, '?');
-  if ( store_path_info(env, path, question_at) < 0 ) {
-    rb_hash_clear(env);
-    ret = -1;
-    goto done;
+  while ( sp->pos < _spill_size(sp) ) {
+    n = _spill_peek(sp, &ptr);
+    lf = memchr(ptr, '\n', n);
+    if ( lf != NULL ) {
+      n = lf - ptr + 1;
+    }
+    if ( NIL_P(line) ) {
+      line = rb_str_new(ptr, n);
+    }
+    else {
+      /* the line continues from head to the file */
+      rb_str_cat(line, ptr, n);
+    }
+    sp->pos += n;
+    if ( lf != NULL ) {
+      break;
+    }
   }
-  if (question_at != path_len) ++question_at;
-  rb_hash_aset(env, query_string_key, rb_str_new(path + question_at, path_len - question_at));
-  last_value = Qnil;
+  return line;
+}
 
-  for (i = 0; i < num_headers; ++i) {
-    if (headers[i].name != NULL) {
-      const char* name;
-      size_t name_len;
-      VALUE slot;
-      VALUE env_key;
-      env_key = find_common_header(headers + i);
-      if ( NIL_P(env_key) ) {
-        const char* s;
-        char* d;
-        size_t n;
-        if (sizeof(tmp) - 5 < headers[i].name_len) {
-          rb_hash_clear(env);
-          ret = -1;
-          goto done;
-        }
-        for (s = headers[i].name, n = headers[i].name_len, d = tmp + 5;
-          n != 0;
-          s++, --n, d++) {
-            *d = *s == '-' ? '_' : TOU(*s);
-            name = tmp;
-            name_len = headers[i].name_len + 5;
-            env_key = rb_str_new(name, name_len);
-        }
-      }
-      slot = rb_hash_aref(env, env_key);
-      if ( !NIL_P(slot) ) {
-        rb_str_cat2(slot, ", ");
-        rb_str_cat(slot, headers[i].value, headers[i].value_len);
-      } else {
-        slot = rb_str_new(headers[i].value, headers[i].value_len);
-        rb_hash_aset(env, env_key, slot);
-        last_value = slot;
-      }
-    } else {
-      // continuing lines of a mulitiline header
-        if ( !NIL_P(last_value) )
-          rb_str_cat(last_value, headers[i].value, headers[i].value_len);
-    }
+static
+VALUE rhe_spill_each(VALUE self) {
+  VALUE line;
+  RETURN_ENUMERATOR(self, 0, 0);
+  while ( !NIL_P(line = rhe_spill_gets(self)) ) {
+    rb_yield(line);
   }
- done:
-  return ret;
+  return self;
 }
 
+static
+VALUE rhe_spill_eof_p(VALUE self) {
+  struct spill_buffer *sp = _spill(self);
+  return sp->pos >= _spill_size(sp) ? Qtrue : Qfalse;
+}
 
+static
+VALUE rhe_spill_close(VALUE self) {
+  struct spill_buffer *sp;
+  TypedData_Get_Struct(self, struct spill_buffer, &spill_type, sp);
+  _spill_release(sp);
+  sp->closed = 1;
+  return Qnil;
+}
 
+/* decode chunked request body into sink, a SpillBuffer or an object that
+   responds to print. returns bytes after the body */
 static
-VALUE rhe_accept(VALUE self, VALUE fileno, VALUE timeoutv, VALUE tcp, VALUE env) {
-  struct sockaddr_in cliaddr;
-  unsigned int len;
-  char read_buf[MAX_HEADER_SIZE];
-  VALUE req;
-  int flag = 1;
-  ssize_t rv = 0;
-  ssize_t buf_len;
-  ssize_t reqlen;
-  int fd;
+VALUE rhe_read_chunked(VALUE self, VALUE filenov, VALUE bufv, VALUE sink, VALUE max_sizev, VALUE timeoutv) {
+  char read_buf[READ_BUF];
+  struct chunked_decoder decoder;
+  ssize_t rv;
+  ssize_t ret;
+  size_t bufsz;
+  size_t total = 0;
+  long buf_offset = 0;
+  int fileno = NUM2INT(filenov);
+  size_t max_size = NUM2SIZET(max_sizev);
   double timeout = NUM2DBL(timeoutv);
+  struct spill_buffer *spill = NULL;
 
-  len = sizeof(cliaddr);
-  fd = _accept(NUM2INT(fileno), (struct sockaddr *)&cliaddr, len);
+  long long body_started = metrics_enabled ? _now_ns() : 0;
 
-  /* endif */
-  if (fd < 0) {
-    goto badexit;
+  if ( rb_typeddata_is_kind_of(sink, &spill_type) ) {
+    spill = _spill(sink);
   }
-
-  rv = _read_timeout(fd, timeout, &read_buf[0], MAX_HEADER_SIZE);
-  if ( rv <= 0 ) {
-    close(fd);
-    goto badexit;
+  memset(&decoder, 0, sizeof(decoder));
+  _sb_state(SB_READING);
+  while (1) {
+    if ( RSTRING_LEN(bufv) > buf_offset ) {
+      /* pipelined bytes read with the request header */
+      rv = RSTRING_LEN(bufv) - buf_offset;
+      if ( rv > READ_BUF )
+        rv = READ_BUF;
+      memcpy(read_buf, RSTRING_PTR(bufv) + buf_offset, rv);
+      buf_offset += rv;
+    }
+    else {
+      rv = _read_timeout(fileno, timeout, read_buf, READ_BUF);
+      if ( rv <= 0 ) {
+        return Qnil;
+      }
+    }
+    bufsz = rv;
+    ret = _decode_chunked(&decoder, read_buf, &bufsz);
+    if ( ret == -1 ) {
+      _write_timeout(fileno, timeout, BAD_REQUEST, sizeof(BAD_REQUEST) - 1);
+      return Qnil;
+    }
+    total += bufsz;
+    if ( max_size > 0 && total > max_size ) {
+      _write_timeout(fileno, timeout, ENTITY_TOO_LARGE, sizeof(ENTITY_TOO_LARGE) - 1);
+      return Qnil;
+    }
+    if ( bufsz > 0 ) {
+      if ( spill != NULL ) {
+        if ( _spill_write(spill, read_buf, bufsz) < 0 ) {
+          return Qnil;
+        }
+      }
+      else {
+        rb_funcall(sink, id_print, 1, rb_str_new(read_buf, bufsz));
+      }
+    }
+    if ( ret >= 0 ) {
+      VALUE rest = rb_str_new(&read_buf[bufsz], ret);
+      rb_str_cat(rest, RSTRING_PTR(bufv) + buf_offset, RSTRING_LEN(bufv) - buf_offset);
+      _sb_state(SB_APP);
+      if ( metrics_enabled ) {
+        _header_arena()->app_started = _phase_done(PHASE_BODY, &body_started);
+      }
+      return rest;
+    }
   }
+}
 
-  if ( tcp == Qtrue ) {
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(int));
-    rb_hash_aset(env, remote_addr_key, rb_str_new2(inet_ntoa(cliaddr.sin_addr)));
-    rb_hash_aset(env, remote_port_key, rb_fix2str(INT2FIX(ntohs(cliaddr.sin_port)),10));
-  }
-  else {
-    rb_hash_aset(env, remote_addr_key, vacant_string_val);
-    rb_hash_aset(env, remote_port_key, zero_string_val);
-  }
+/*
+ * read request body of length bytes. sink is a SpillBuffer, a String to
+ * append to or a fileno of the spill file. returns bytes after the body
+ */
+static
+VALUE rhe_read_body(VALUE self, VALUE filenov, VALUE bufv, VALUE lengthv, VALUE sink, VALUE timeoutv) {
+  char read_buf[READ_BUF];
+  ssize_t rv;
+  long n;
+  int fileno = NUM2INT(filenov);
+  long remain = NUM2LONG(lengthv);
+  long buf_len = RSTRING_LEN(bufv);
+  double timeout = NUM2DBL(timeoutv);
+  int sink_fd = -1;
+  struct spill_buffer *spill = NULL;
+  VALUE rest;
+  long long body_started = metrics_enabled ? _now_ns() : 0;
 
-  buf_len = rv;
-  while (1) {
-    reqlen = _parse_http_request(&read_buf[0],buf_len,env);
-    if ( reqlen >= 0 ) {
-      break;
-    }
-    else if ( reqlen == -1 ) {
-      /* error */
-      close(fd);
-      goto badexit;
+  if ( rb_typeddata_is_kind_of(sink, &spill_type) ) {
+    spill = _spill(sink);
+    if ( spill->fd < 0 && RSTRING_LEN(spill->head) + remain > spill->memory_max ) {
+      _spill_open(spill);
     }
-    if ( MAX_HEADER_SIZE - buf_len == 0 ) {
-      /* too large header  */
-     char* badreq;
-     badreq = BAD_REQUEST;
-     rv = _write_timeout(fd, timeout, badreq, sizeof(BAD_REQUEST) - 1);
-     close(fd);
-     goto badexit;
+    if ( spill->fd < 0 ) {
+      sink = spill->head;
     }
-    /* request is incomplete */
-    rv = _read_timeout(fd, timeout, &read_buf[buf_len], MAX_HEADER_SIZE - buf_len);
-    if ( rv <= 0 ) {
-      close(fd);
-      goto badexit;
+    else {
+      sink_fd = spill->fd;
+      spill->file_size += remain;
     }
-    buf_len += rv;
+  }
+  else if ( !RB_TYPE_P(sink, T_STRING) ) {
+    sink_fd = NUM2INT(sink);
   }
 
-  //rv = _write_timeout(fd, timeout, "HTTP/1.0 200 OK\r\nConnection: close\r\n\r\n200 OK\r\n",
-  //                    sizeof("HTTP/1.0 200 OK\r\nConnection: close\r\n\r\n200 OK\r\n") - 1);
-  //close(fd);
-  //goto badexit;
+  _sb_state(SB_READING);
+  /* pipelined bytes read with the request header */
+  n = ( buf_len > remain ) ? remain : buf_len;
+  rest = rb_str_new(RSTRING_PTR(bufv) + n, buf_len - n);
+  if ( sink_fd < 0 ) {
+    rb_str_modify_expand(sink, remain);
+    rb_str_cat(sink, RSTRING_PTR(bufv), n);
+  }
+  else if ( _write_all_fd(sink_fd, RSTRING_PTR(bufv), n) < 0 ) {
+    return Qnil;
+  }
+  remain -= n;
 
-  VALUE expect_val = rb_hash_aref(env, expect_key);
-  if ( !NIL_P(expect_val) ) {
-      if ( strncmp(RSTRING_PTR(expect_val), "100-continue", RSTRING_LEN(expect_val)) == 0 ) {
-          rv = _write_timeout(fd, timeout, EXPECT_CONTINUE, sizeof(EXPECT_CONTINUE) - 1);
-          if ( rv <= 0 ) {
-              close(fd);
-              goto badexit;
-          }
-      } else {
-          rv = _write_timeout(fd, timeout, EXPECT_FAILED, sizeof(EXPECT_FAILED) - 1);
-          close(fd);
-          goto badexit;
+  while ( remain > 0 ) {
+    if ( sink_fd < 0 ) {
+      /* read directly into the reserved capacity */
+      rv = _read_timeout(fileno, timeout, RSTRING_PTR(sink) + RSTRING_LEN(sink), remain);
+      if ( rv <= 0 ) {
+        return Qnil;
+      }
+      rb_str_set_len(sink, RSTRING_LEN(sink) + rv);
+    }
+    else {
+      rv = _read_timeout(fileno, timeout, read_buf, (remain > READ_BUF) ? READ_BUF : remain);
+      if ( rv <= 0 || _write_all_fd(sink_fd, read_buf, rv) < 0 ) {
+        return Qnil;
       }
+    }
+    remain -= rv;
   }
-
-  req = rb_ary_new2(2);
-  rb_ary_push(req, INT2NUM(fd));
-  rb_ary_push(req, rb_str_new(&read_buf[reqlen],buf_len - reqlen));
-  return req;
- badexit:
-  return Qnil;
+  _sb_state(SB_APP);
+  if ( metrics_enabled ) {
+    _header_arena()->app_started = _phase_done(PHASE_BODY, &body_started);
+  }
+  return rest;
 }
 
 static
@@ -675,353 +3644,886 @@ VALUE rhe_read_timeout(VALUE self, VALUE filenov, VALUE rbuf, VALUE lenv, VALUE
   if ( rv > 0 ) {
     rb_str_cat(rbuf, d, rv);
   }
-  xfree(d);
-  return SSIZET2NUM(rv);
+  xfree(d);
+  return SSIZET2NUM(rv);
+}
+
+static
+VALUE rhe_write_timeout(VALUE self, VALUE fileno, VALUE buf, VALUE len, VALUE offset, VALUE timeout) {
+  char* d;
+  ssize_t rv;
+  buf = rb_String(buf);
+  d = RSTRING_PTR(buf);
+  rv = _write_timeout(NUM2INT(fileno), NUM2DBL(timeout), &d[NUM2LONG(offset)], NUM2LONG(len));
+  if ( rv < 0 ) {
+    return Qnil;
+  }
+  return SSIZET2NUM(rv);
+}
+
+
+static
+VALUE rhe_write_all(VALUE self, VALUE fileno, VALUE buf, VALUE offsetv, VALUE timeout) {
+  char * d;
+  ssize_t buf_len;
+  ssize_t rv = 0;
+  ssize_t written = 0;
+
+  buf = rb_String(buf);
+  d = RSTRING_PTR(buf);
+  buf_len = RSTRING_LEN(buf);
+  _sb_state(SB_WRITING);
+
+  written = 0;
+  while ( buf_len > written ) {
+    rv = _write_timeout(NUM2INT(fileno), NUM2DBL(timeout), &d[written], buf_len - written);
+    if ( rv <= 0 ) {
+      break;
+    }
+    written += rv;
+  }
+  if (rv < 0) {
+    return Qnil;
+  }
+  return SSIZET2NUM(written);
+}
+
+static
+VALUE rhe_write_chunk(VALUE self, VALUE fileno, VALUE buf, VALUE offsetv, VALUE timeout) {
+  ssize_t buf_len;
+  ssize_t written;
+  char chunked_header_buf[18];
+  struct iovec v[3];
+
+  buf = rb_String(buf);
+  buf_len = RSTRING_LEN(buf);
+
+  if ( buf_len == 0 ){
+      return INT2FIX(0);
+  }
+  _sb_state(SB_WRITING);
+
+  v[0].iov_len = _chunked_header(chunked_header_buf,buf_len);
+  v[0].iov_base = chunked_header_buf;
+  v[1].iov_len = buf_len;
+  v[1].iov_base = RSTRING_PTR(buf);
+  v[2].iov_base = (char *)"\r\n";
+  v[2].iov_len = sizeof("\r\n") -1;
+
+  written = _writev_all(NUM2INT(fileno), NUM2DBL(timeout), v, 3, 0);
+  RB_GC_GUARD(buf);
+  if ( written < 0 ) {
+    return Qnil;
+  }
+  return SSIZET2NUM(written);
+}
+
+/* response is built in arena->out. bytes of arena->out become iovecs with
+   iov_base NULL, resolved by _out_finish once out stops moving */
+struct response_writer {
+  struct header_arena *arena;
+  long start;
+  long len;
+  long run;
+  long iovcnt;
+  VALUE date;
+  VALUE server;
+  int has_length;
+  int cacheable;
+};
+
+static
+char * _out_reserve(struct response_writer *rw, long n) {
+  struct header_arena *arena = rw->arena;
+  long size;
+  if ( rw->len + n > arena->out_size ) {
+    size = arena->out_size ? arena->out_size : 4096;
+    while ( rw->len + n > size ) {
+      size *= 2;
+    }
+    REALLOC_N(arena->out, char, size);
+    arena->out_size = size;
+  }
+  return arena->out + rw->len;
+}
+
+static
+void _out_cat(struct response_writer *rw, const char *s, long n) {
+  memcpy(_out_reserve(rw, n), s, n);
+  rw->len += n;
+}
+
+static
+void _out_push_iov(struct response_writer *rw, char *base, long n) {
+  struct header_arena *arena = rw->arena;
+  if ( rw->iovcnt == arena->iov_size ) {
+    arena->iov_size = arena->iov_size ? arena->iov_size * 2 : 16;
+    REALLOC_N(arena->iov, struct iovec, arena->iov_size);
+  }
+  arena->iov[rw->iovcnt].iov_base = base;
+  arena->iov[rw->iovcnt].iov_len = n;
+  rw->iovcnt++;
+}
+
+static
+void _out_flush_run(struct response_writer *rw) {
+  if ( rw->len > rw->run ) {
+    _out_push_iov(rw, NULL, rw->len - rw->run);
+    rw->run = rw->len;
+  }
+}
+
+/* bytes kept by the caller until the response is written */
+static
+void _out_ref(struct response_writer *rw, char *s, long n) {
+  _out_flush_run(rw);
+  _out_push_iov(rw, s, n);
+}
+
+static
+void _out_finish(struct response_writer *rw) {
+  long i;
+  long offset = rw->start;
+  _out_flush_run(rw);
+  for ( i = 0; i < rw->iovcnt; i++ ) {
+    if ( rw->arena->iov[i].iov_base == NULL ) {
+      rw->arena->iov[i].iov_base = rw->arena->out + offset;
+      offset += rw->arena->iov[i].iov_len;
+    }
+  }
+}
+
+/* "key: value\r\n". a value containing "\n" becomes one line per part */
+static
+void _out_header(struct response_writer *rw, const char *key, long key_len, const char *val, long val_len) {
+  long offset = 0;
+  long lf;
+  char *d;
+  while ( 1 ) {
+    lf = find_lf(val, offset, val_len);
+    if ( lf != offset || (offset == 0 && lf == val_len) ) {
+      d = _out_reserve(rw, key_len + (lf - offset) + 4);
+      memcpy(d, key, key_len);
+      d += key_len;
+      *d++ = ':';
+      *d++ = ' ';
+      memcpy(d, val + offset, lf - offset);
+      d += lf - offset;
+      *d++ = 13;
+      *d++ = 10;
+      rw->len += key_len + (lf - offset) + 4;
+    }
+    if ( lf >= val_len - 1 ) {
+      break;
+    }
+    offset = lf + 1;
+  }
+}
+
+#define KEY_IS(k, l, name) ((l) == sizeof(name) - 1 && strncasecmp((k), (name), (l)) == 0)
+
+static
+int _header_write_i(VALUE key_obj, VALUE val_obj, VALUE ptr) {
+  struct response_writer *rw = (struct response_writer *)ptr;
+  const char *key;
+  long key_len;
+
+  if ( !RB_TYPE_P(key_obj, T_STRING) || !RB_OBJ_FROZEN(key_obj) ||
+       !RB_TYPE_P(val_obj, T_STRING) || !RB_OBJ_FROZEN(val_obj) ) {
+    rw->cacheable = 0;
+  }
+  key_obj = rb_String(key_obj);
+  val_obj = rb_String(val_obj);
+  key = RSTRING_PTR(key_obj);
+  key_len = RSTRING_LEN(key_obj);
+
+  if ( KEY_IS(key, key_len, "Connection") ) {
+    return ST_CONTINUE;
+  }
+  if ( KEY_IS(key, key_len, "Content-Length") || KEY_IS(key, key_len, "Transfer-Encoding") ) {
+    rw->has_length = 1;
+  }
+  if ( KEY_IS(key, key_len, "Date") ) {
+    rw->date = val_obj;
+    return ST_CONTINUE;
+  }
+  if ( KEY_IS(key, key_len, "Server") ) {
+    rw->server = val_obj;
+    return ST_CONTINUE;
+  }
+  _out_header(rw, key, key_len, RSTRING_PTR(val_obj), RSTRING_LEN(val_obj));
+  RB_GC_GUARD(key_obj);
+  RB_GC_GUARD(val_obj);
+  return ST_CONTINUE;
 }
 
+/* serializes headers except Date and Server after OUT_PREFIX_ROOM */
 static
-VALUE rhe_write_timeout(VALUE self, VALUE fileno, VALUE buf, VALUE len, VALUE offset, VALUE timeout) {
-  char* d;
-  ssize_t rv;
-  buf = rb_String(buf);
-  d = RSTRING_PTR(buf);
-  rv = _write_timeout(NUM2INT(fileno), NUM2DBL(timeout), &d[NUM2LONG(offset)], NUM2LONG(len));
-  if ( rv < 0 ) {
-    return Qnil;
+void _out_headers(struct response_writer *rw, VALUE headers) {
+  struct header_arena *arena = rw->arena;
+  struct header_cache *hc;
+  int frozen = RB_OBJ_FROZEN(headers);
+  int i;
+
+  _out_reserve(rw, OUT_PREFIX_ROOM);
+  rw->len = OUT_PREFIX_ROOM;
+  if ( frozen ) {
+    for ( i = 0; i < HEADER_CACHE_SIZE; i++ ) {
+      hc = &arena->hcache[i];
+      if ( hc->headers == headers ) {
+        _out_cat(rw, hc->buf, hc->len);
+        rw->date = hc->date;
+        rw->server = hc->server;
+        rw->has_length = hc->has_length;
+        return;
+      }
+    }
+  }
+  rw->cacheable = frozen;
+  rb_hash_foreach(headers, _header_write_i, (VALUE)rw);
+  if ( rw->cacheable ) {
+    hc = &arena->hcache[arena->hcache_next];
+    arena->hcache_next = (arena->hcache_next + 1) % HEADER_CACHE_SIZE;
+    if ( hc->size < rw->len - OUT_PREFIX_ROOM ) {
+      REALLOC_N(hc->buf, char, rw->len - OUT_PREFIX_ROOM);
+      hc->size = rw->len - OUT_PREFIX_ROOM;
+    }
+    memcpy(hc->buf, arena->out + OUT_PREFIX_ROOM, rw->len - OUT_PREFIX_ROOM);
+    hc->len = rw->len - OUT_PREFIX_ROOM;
+    hc->headers = headers;
+    hc->date = rw->date;
+    hc->server = rw->server;
+    hc->has_length = rw->has_length;
   }
-  return SSIZET2NUM(rv);
 }
 
+/* puts status line, Date and Server in front of the serialized headers */
+static
+void _out_prefix(struct response_writer *rw, int status_code) {
+  char line[512];
+  const char *status;
+  int status_len;
+  long headers_end = rw->len;
+  long prefix_len;
+  char *prefix;
+
+  if ( STATUS_LINE_MIN <= status_code && status_code <= STATUS_LINE_MAX ) {
+    status = status_lines[status_code - STATUS_LINE_MIN];
+    status_len = status_line_lens[status_code - STATUS_LINE_MIN];
+  }
+  else {
+    status_len = _status_line(line, status_code);
+    status = line;
+  }
+  /* build the prefix after the headers, then move it into the room */
+  _out_cat(rw, status, status_len);
+  if ( rw->date ) {
+    _out_header(rw, "Date", sizeof("Date") - 1, RSTRING_PTR(rw->date), RSTRING_LEN(rw->date));
+  }
+  else {
+    /* date_buf can be updated by other threads. copy it now */
+    _out_cat(rw, _date_header(), sizeof(date_buf));
+  }
+  if ( rw->server ) {
+    _out_header(rw, "Server", sizeof("Server") - 1, RSTRING_PTR(rw->server), RSTRING_LEN(rw->server));
+  }
+  else {
+    _out_cat(rw, "Server: Rhebok\r\n", sizeof("Server: Rhebok\r\n") - 1);
+  }
+  prefix_len = rw->len - headers_end;
+  rw->len = headers_end;
+  if ( prefix_len <= OUT_PREFIX_ROOM ) {
+    memcpy(rw->arena->out + OUT_PREFIX_ROOM - prefix_len, rw->arena->out + headers_end, prefix_len);
+    rw->start = rw->run = OUT_PREFIX_ROOM - prefix_len;
+    return;
+  }
+  /* very long Date or Server */
+  prefix = ALLOC_N(char, prefix_len);
+  memcpy(prefix, rw->arena->out + headers_end, prefix_len);
+  _out_reserve(rw, prefix_len - OUT_PREFIX_ROOM);
+  memmove(rw->arena->out + prefix_len, rw->arena->out + OUT_PREFIX_ROOM, headers_end - OUT_PREFIX_ROOM);
+  memcpy(rw->arena->out, prefix, prefix_len);
+  xfree(prefix);
+  rw->len = headers_end + prefix_len - OUT_PREFIX_ROOM;
+  rw->start = rw->run = 0;
+}
 
 static
-VALUE rhe_write_all(VALUE self, VALUE fileno, VALUE buf, VALUE offsetv, VALUE timeout) {
-  char * d;
-  ssize_t buf_len;
+VALUE rhe_sendfile(VALUE self, VALUE filenov, VALUE file_filenov, VALUE offsetv, VALUE lengthv, VALUE timeoutv) {
   ssize_t rv = 0;
   ssize_t written = 0;
+  int fileno = NUM2INT(filenov);
+  int file_fd = NUM2INT(file_filenov);
+  off_t offset = NUM2OFFT(offsetv);
+  ssize_t len = NUM2SSIZET(lengthv);
+  double timeout = NUM2DBL(timeoutv);
 
-  buf = rb_String(buf);
-  d = RSTRING_PTR(buf);
-  buf_len = RSTRING_LEN(buf);
-
-  written = 0;
-  while ( buf_len > written ) {
-    rv = _write_timeout(NUM2INT(fileno), NUM2DBL(timeout), &d[written], buf_len - written);
+  _sb_state(SB_WRITING);
+  while ( len > written ) {
+    rv = _sendfile_timeout(fileno, timeout, file_fd, &offset, len - written);
     if ( rv <= 0 ) {
       break;
     }
     written += rv;
   }
-  if (rv < 0) {
+  if ( len > written ) {
+    /* error, disconnected or file was truncated */
     return Qnil;
   }
   return SSIZET2NUM(written);
 }
 
 static
-VALUE rhe_write_chunk(VALUE self, VALUE fileno, VALUE buf, VALUE offsetv, VALUE timeout) {
-  ssize_t buf_len;
-  ssize_t rv = 0;
-  ssize_t written = 0;
-  ssize_t vec_offset = 0;
-  ssize_t count =0;
-  ssize_t remain;
-  ssize_t iovcnt = 3;
-  char chunked_header_buf[18];
+VALUE rhe_close(VALUE self, VALUE fileno) {
+  const int fd = NUM2INT(fileno);
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  if ( fd < RARRAY_LEN(wait_ios) ) {
+    rb_ary_store(wait_ios, fd, Qnil);
+  }
+#endif
+  close(fd);
+  _sb_state(SB_IDLE);
+  _metrics_write_done();
+  return Qnil;
+}
 
-  buf = rb_String(buf);
-  buf_len = RSTRING_LEN(buf);
+/* status line and headers of a response, up to the empty line. Array body
+   is counted for Content-Length if keep-alive needs it, Qnil if streamed.
+   returns use_chunked, cleared for statuses without body */
+static
+int _out_response_head(struct response_writer *rw, int status_code, VALUE headers, VALUE body, int use_chunked, int keepalive) {
+  char content_length_line[sizeof("Content-Length: \r\n") + 20];
+  ssize_t content_length = 0;
+  long i;
 
-  if ( buf_len == 0 ){
-      return INT2FIX(0);
+  _sb_state(SB_WRITING);
+  rw->arena = _header_arena();
+  if ( metrics_enabled ) {
+    rw->arena->write_started = _phase_done(PHASE_APP, &rw->arena->app_started);
   }
+  _out_headers(rw, headers);
+  _out_prefix(rw, status_code);
 
-  {
-    struct iovec v[iovcnt]; // Needs C99 compiler
-    v[0].iov_len = _chunked_header(chunked_header_buf,buf_len);
-    v[0].iov_base = chunked_header_buf;
-    v[1].iov_len = buf_len;
-    v[1].iov_base = RSTRING_PTR(buf);
-    v[2].iov_base = "\r\n";
-    v[2].iov_len = sizeof("\r\n") -1;
-
-    vec_offset = 0;
-    written = 0;
-    remain = iovcnt;
-    while ( remain > 0 ) {
-      count = (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt;
-      rv = _writev_timeout(NUM2INT(fileno), NUM2DBL(timeout),  &v[vec_offset], count - vec_offset, (vec_offset == 0) ? 0 : 1);
-      if ( rv <= 0 ) {
-        // error or disconnected
-        break;
-      }
-      written += rv;
-      while ( rv > 0 ) {
-        if ( (unsigned int)rv >= v[vec_offset].iov_len ) {
-          rv -= v[vec_offset].iov_len;
-          vec_offset++;
-          remain--;
-        }
-        else {
-          v[vec_offset].iov_base = (char*)v[vec_offset].iov_base + rv;
-          v[vec_offset].iov_len -= rv;
-          rv = 0;
-        }
-      }
+  /* status_with_no_entity_body */
+  if ( status_code < 200 || status_code == 204 || status_code == 304 ) {
+    use_chunked = 0;
+    rw->has_length = 1;
+  }
+  if ( keepalive && use_chunked == 0 && rw->has_length == 0 && !NIL_P(body) ) {
+    /* keep-alive needs a framed body. count Array body */
+    for ( i=0; i<RARRAY_LEN(body); i++) {
+      content_length += RSTRING_LEN(rb_String(rb_ary_entry(body, i)));
     }
+    _out_cat(rw, content_length_line,
+             sprintf(content_length_line, "Content-Length: %ld\r\n", (long)content_length));
   }
-  if ( rv < 0 ) {
-    return Qnil;
+  if ( use_chunked ) {
+    _out_cat(rw, "Transfer-Encoding: chunked\r\n", sizeof("Transfer-Encoding: chunked\r\n") - 1);
   }
-  return SSIZET2NUM(written);
+  if ( keepalive ) {
+    _out_cat(rw, "Connection: keep-alive\r\n\r\n", sizeof("Connection: keep-alive\r\n\r\n") - 1);
+  }
+  else {
+    _out_cat(rw, "Connection: close\r\n\r\n", sizeof("Connection: close\r\n\r\n") - 1);
+  }
+  return use_chunked;
 }
 
+/* streamed body parts are buffered in arena->out after the response head and
+   a room for the chunk size line, and written when flush_size is reached */
+#define STREAM_CHUNK_ROOM 18
+
+struct stream_writer {
+  struct response_writer rw;
+  int fd;
+  double timeout;
+  int chunked;
+  long flush_size;
+  long head_len;
+  long data_start;
+  ssize_t written;
+  int failed;
+};
+
+/* writes the head if not yet, buffered parts, part and the last chunk if
+   final. MSG_MORE unless final when buffering */
 static
-int header_to_array(VALUE key_obj, VALUE val_obj, VALUE ary) {
-  ssize_t val_len;
-  ssize_t val_offset;
-  long val_lf;
-  char * val;
+int _stream_flush(struct stream_writer *sw, VALUE part, int final) {
+  struct iovec v[6];
+  long n = 0;
+  long data_len = sw->rw.len - sw->data_start;
+  char *out;
+  char chunked_header_buf[STREAM_CHUNK_ROOM];
+  char part_header_buf[STREAM_CHUNK_ROOM];
+  int hl;
+  ssize_t rv;
 
-  val_obj = rb_String(val_obj);
-  val = RSTRING_PTR(val_obj);
-  val_len = RSTRING_LEN(val_obj);
-  val_offset = 0;
-  val_lf = find_lf(val, val_offset, val_len);
-  if ( val_lf < val_len ) {
-    /* contain "\n" */
-    while ( val_offset < val_len ) {
-      if ( val_offset != val_lf ) {
-        rb_ary_push(ary, key_obj);
-        rb_ary_push(ary, rb_str_new(&val[val_offset],val_lf - val_offset));
-      }
-      val_offset = val_lf + 1;
-      val_lf = find_lf(val, val_offset, val_len);
+  if ( data_len > 0 && sw->chunked ) {
+    _out_cat(&sw->rw, "\r\n", sizeof("\r\n") - 1);
+  }
+  out = sw->rw.arena->out;
+  if ( sw->head_len > 0 ) {
+    v[n].iov_base = out + sw->rw.start;
+    v[n].iov_len = sw->head_len;
+    n++;
+  }
+  if ( data_len > 0 ) {
+    hl = 0;
+    if ( sw->chunked ) {
+      hl = _chunked_header(chunked_header_buf, data_len);
+      memcpy(out + sw->data_start - hl, chunked_header_buf, hl);
     }
+    v[n].iov_base = out + sw->data_start - hl;
+    v[n].iov_len = sw->rw.len - sw->data_start + hl;
+    n++;
   }
-  else {
-    rb_ary_push(ary, key_obj);
-    rb_ary_push(ary, val_obj);
+  if ( !NIL_P(part) ) {
+    if ( sw->chunked ) {
+      v[n].iov_base = part_header_buf;
+      v[n].iov_len = _chunked_header(part_header_buf, RSTRING_LEN(part));
+      n++;
+    }
+    v[n].iov_base = RSTRING_PTR(part);
+    v[n].iov_len = RSTRING_LEN(part);
+    n++;
+    if ( sw->chunked ) {
+      v[n].iov_base = (char *)"\r\n";
+      v[n].iov_len = sizeof("\r\n") - 1;
+      n++;
+    }
   }
-  return ST_CONTINUE;
+  if ( final && sw->chunked ) {
+    v[n].iov_base = (char *)"0\r\n\r\n";
+    v[n].iov_len = sizeof("0\r\n\r\n") - 1;
+    n++;
+  }
+  sw->head_len = 0;
+  sw->rw.len = sw->data_start;
+  if ( n == 0 ) {
+    return 0;
+  }
+  rv = _writev_all(sw->fd, sw->timeout, v, n, !final && sw->flush_size > 0);
+  RB_GC_GUARD(part);
+  if ( rv < 0 ) {
+    sw->failed = 1;
+    return -1;
+  }
+  sw->written += rv;
+  return 0;
 }
 
 static
-VALUE rhe_close(VALUE self, VALUE fileno) {
-  close(NUM2INT(fileno));
+VALUE _stream_part_i(RB_BLOCK_CALL_FUNC_ARGLIST(part, ptr)) {
+  struct stream_writer *sw = (struct stream_writer *)ptr;
+  long part_len;
+  int rv = 0;
+
+  part = rb_String(part);
+  part_len = RSTRING_LEN(part);
+  if ( part_len == 0 ) {
+    return Qnil;
+  }
+  if ( part_len >= sw->flush_size ) {
+    /* large part is written from the String with buffered ones */
+    rv = _stream_flush(sw, part, 0);
+  }
+  else {
+    _out_cat(&sw->rw, RSTRING_PTR(part), part_len);
+    if ( sw->rw.len - sw->data_start >= sw->flush_size ) {
+      rv = _stream_flush(sw, Qnil, 0);
+    }
+  }
+  if ( rv < 0 ) {
+    rb_iter_break();
+  }
   return Qnil;
 }
 
 static
-VALUE rhe_write_response(VALUE self, VALUE filenov, VALUE timeoutv, VALUE status_codev, VALUE headers, VALUE body, VALUE use_chunkedv, VALUE header_onlyv) {
-  ssize_t hlen = 0;
-  ssize_t blen = 0;
-
-  ssize_t rv = 0;
-  ssize_t iovcnt;
-  ssize_t vec_offset;
+VALUE rhe_write_response(VALUE self, VALUE filenov, VALUE timeoutv, VALUE status_codev, VALUE headers, VALUE body, VALUE use_chunkedv, VALUE header_onlyv, VALUE keepalivev) {
+  ssize_t blen;
   ssize_t written;
-  ssize_t count;
-  int i;
-  ssize_t remain;
-  char status_line[512] = "HTTP/1.1 ";
-  char * date_line;
-  int date_pushed = 0;
-  char * server_line;
-  int server_pushed = 0;
-  VALUE harr;
-  VALUE key_obj;
-  VALUE val_obj;
-  char * key;
-  ssize_t key_len;
-  const char * message;
-
-  const char * s;
-  char * d;
-  ssize_t n;
+  ssize_t i;
+  long part_len;
+  VALUE part;
+  char chunked_header_buf[18];
+  struct response_writer rw;
 
-  char * chunked_header_buf;
-  
   int fileno = NUM2INT(filenov);
   double timeout = NUM2DBL(timeoutv);
   int status_code = NUM2INT(status_codev);
   int use_chunked = NUM2INT(use_chunkedv);
+  /* 0: body is Array, 1: body will be streamed, 2: file body will be sent by sendfile */
   int header_only = NUM2INT(header_onlyv);
+  int keepalive = NUM2INT(keepalivev);
 
-  /* status_with_no_entity_body */
-  if ( status_code < 200 || status_code == 204 || status_code == 304 ) {
-    use_chunked = 0;
-  }
-  
-  harr = rb_ary_new2(RHASH_SIZE(headers) * 2);
-  RB_GC_GUARD(harr);
-  rb_hash_foreach(headers, header_to_array, harr);
-  hlen = RARRAY_LEN(harr);
+  memset(&rw, 0, sizeof(rw));
+  use_chunked = _out_response_head(&rw, status_code, headers, header_only == 0 ? body : Qnil, use_chunked, keepalive);
   blen = RARRAY_LEN(body);
-  iovcnt = 10 + (hlen * 2) + blen;
-  if ( use_chunked ) {
-      iovcnt += blen*2;
-      chunked_header_buf = ALLOC_N(char, 32 * blen);
+
+  for ( i=0; i<blen; i++) {
+    part = rb_ary_entry(body, i);
+    if ( !RB_TYPE_P(part, T_STRING) ) {
+      /* converted String is not referenced by body. always copy it */
+      part = rb_String(part);
+    }
+    part_len = RSTRING_LEN(part);
+    if ( part_len == 0 ) {
+      continue;
+    }
+    if ( use_chunked ) {
+      _out_cat(&rw, chunked_header_buf, _chunked_header(chunked_header_buf, part_len));
+    }
+    if ( (part_len <= OUT_COALESCE_PART && rw.len < OUT_COALESCE_MAX) || part != rb_ary_entry(body, i) ) {
+      _out_cat(&rw, RSTRING_PTR(part), part_len);
+    }
+    else {
+      _out_ref(&rw, RSTRING_PTR(part), part_len);
+    }
+    if ( use_chunked ) {
+      _out_cat(&rw, "\r\n", sizeof("\r\n") - 1);
+    }
   }
+  if ( use_chunked && header_only == 0 ) {
+    _out_cat(&rw, "0\r\n\r\n", sizeof("0\r\n\r\n") - 1);
+  }
+  _out_finish(&rw);
 
-  {
-    struct iovec v[iovcnt]; // Needs C99 compiler
-    size_t mlen;
-    /* status line */
-    iovcnt = 0;
-    i = sizeof("HTTP/1.1 ") - 1;
-    str_i(status_line,&i,status_code,3);
-    status_line[i++] = ' ';
-    message = status_message(status_code, &mlen);
-    str_s(status_line, &i, message, mlen);
-    status_line[i++] = 13;
-    status_line[i++] = 10;
-    v[iovcnt].iov_base = status_line;
-    v[iovcnt].iov_len = i;
-    iovcnt++;
-
-    /* for date header */
-    iovcnt++;
-
-    v[iovcnt].iov_base = "Server: Rhebok\r\n";
-    v[iovcnt].iov_len = sizeof("Server: Rhebok\r\n")-1;
-    iovcnt++;
-
-    date_pushed = 0;
-
-    for ( i = 0; i < hlen; i++ ) {
-      key_obj = rb_ary_entry(harr, i);
-      key = RSTRING_PTR(key_obj);
-      key_len = RSTRING_LEN(key_obj);
-      i++;
-
-      if ( strncasecmp(key,"Connection",key_len) == 0 ) {
-        continue;
-      }
+  written = _writev_all(fileno, timeout, rw.arena->iov, rw.iovcnt, header_only == 2);
+  RB_GC_GUARD(body);
+  if ( written < 0 ) {
+    return Qnil;
+  }
+  return SSIZET2NUM(written);
+}
 
-      val_obj = rb_ary_entry(harr, i);
+/* rack.input reading the request body from the socket as the app asks for
+   it. bytes read with the request header are consumed first. body bytes are
+   kept in buf for rewind until rewind_size is exceeded */
+struct rhe_input {
+  int fd;
+  double timeout;
+  long remain;  /* bytes left of Content-Length. -1 for chunked */
+  struct chunked_decoder decoder;
+  size_t max_size;
+  size_t total;
+  VALUE src;
+  long src_off;
+  VALUE buf;
+  long pos;
+  long rewind_size;
+  int rewindable;
+  int eof;
+  VALUE rest;
+};
 
-      if ( strncasecmp(key,"Date",key_len) == 0 ) {
-        date_line = ALLOC_N(char, sizeof("Date: ")-1 + RSTRING_LEN(val_obj) + sizeof("\r\n")-1);
-        strcpy(date_line, "Date: ");
-        for ( s=RSTRING_PTR(val_obj), n = RSTRING_LEN(val_obj), d=date_line+sizeof("Date: ")-1; n !=0; s++, --n, d++) {
-          *d = *s;
-        }
-        date_line[sizeof("Date: ") -1 + RSTRING_LEN(val_obj)] = 13;
-        date_line[sizeof("Date: ") -1 + RSTRING_LEN(val_obj) + 1] = 10;
-        v[1].iov_base = date_line;
-        v[1].iov_len = sizeof("Date: ") -1 + RSTRING_LEN(val_obj) + 2;
-        date_pushed = 1;
-        continue;
+static
+void _input_mark(void *ptr) {
+  struct rhe_input *in = (struct rhe_input *)ptr;
+  rb_gc_mark(in->src);
+  rb_gc_mark(in->buf);
+  rb_gc_mark(in->rest);
+}
+
+static
+size_t _input_memsize(const void *ptr) {
+  return sizeof(struct rhe_input);
+}
+
+static const rb_data_type_t input_type = {
+  "rhebok_input",
+  { _input_mark, RUBY_TYPED_DEFAULT_FREE, _input_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static
+VALUE _input_alloc(VALUE klass) {
+  struct rhe_input *in;
+  VALUE obj = TypedData_Make_Struct(klass, struct rhe_input, &input_type, in);
+  in->fd = -1;
+  in->src = Qnil;
+  in->buf = Qnil;
+  in->rest = Qnil;
+  return obj;
+}
+
+static
+struct rhe_input * _input(VALUE self) {
+  struct rhe_input *in;
+  TypedData_Get_Struct(self, struct rhe_input, &input_type, in);
+  if ( NIL_P(in->buf) ) {
+    rb_raise(rb_eIOError, "uninitialized rack.input");
+  }
+  return in;
+}
+
+/*
+ * Rhebok::Input.new(fileno, buf, content_length, max_size, timeout, rewind_size)
+ * content_length is -1 for chunked body, limited by max_size (0 is no limit)
+ */
+static
+VALUE rhe_input_initialize(VALUE self, VALUE filenov, VALUE bufv, VALUE lengthv, VALUE max_sizev, VALUE timeoutv, VALUE rewind_sizev) {
+  struct rhe_input *in;
+  TypedData_Get_Struct(self, struct rhe_input, &input_type, in);
+  in->fd = NUM2INT(filenov);
+  in->src = rb_str_new_frozen(StringValue(bufv));
+  in->remain = NUM2LONG(lengthv);
+  in->max_size = NUM2SIZET(max_sizev);
+  in->timeout = NUM2DBL(timeoutv);
+  in->rewind_size = NUM2LONG(rewind_sizev);
+  in->rewindable = 1;
+  in->buf = rb_str_buf_new(0);
+  return self;
+}
+
+/* appends next body bytes to buf. returns 0 once the body has ended */
+static
+int _input_pull(struct rhe_input *in) {
+  char raw[READ_BUF];
+  ssize_t rv;
+  ssize_t ret = -2;
+  size_t n = 0;
+  long want;
+  long len;
+
+  if ( in->eof ) {
+    return 0;
+  }
+  if ( !in->rewindable && in->pos > 0 ) {
+    /* consumed bytes are not needed any more */
+    len = RSTRING_LEN(in->buf) - in->pos;
+    rb_str_modify(in->buf);
+    memmove(RSTRING_PTR(in->buf), RSTRING_PTR(in->buf) + in->pos, len);
+    rb_str_set_len(in->buf, len);
+    in->pos = 0;
+  }
+  want = ( in->remain >= 0 && in->remain < READ_BUF ) ? in->remain : READ_BUF;
+  if ( want > 0 ) {
+    if ( RSTRING_LEN(in->src) > in->src_off ) {
+      rv = RSTRING_LEN(in->src) - in->src_off;
+      if ( rv > want )
+        rv = want;
+      memcpy(raw, RSTRING_PTR(in->src) + in->src_off, rv);
+      in->src_off += rv;
+    }
+    else {
+      rv = _read_timeout(in->fd, in->timeout, raw, want);
+      if ( rv <= 0 ) {
+        rb_raise(rb_eEOFError, "request body was not received");
       }
-      if ( strncasecmp(key,"Server",key_len) == 0 ) {
-        server_line = ALLOC_N(char, sizeof("Server: ")-1 + RSTRING_LEN(val_obj) + sizeof("\r\n")-1);
-        strcpy(server_line, "Server: ");
-        for ( s=RSTRING_PTR(val_obj), n = RSTRING_LEN(val_obj), d=server_line+sizeof("Server: ")-1; n !=0; s++, --n, d++) {
-          *d = *s;
-        }
-        server_line[sizeof("Server: ") -1 + RSTRING_LEN(val_obj)] = 13;
-        server_line[sizeof("Server: ") -1 + RSTRING_LEN(val_obj) + 1] = 10;
-        v[2].iov_base = server_line;
-        v[2].iov_len = sizeof("Server: ") -1 + RSTRING_LEN(val_obj) + 2;
-        server_pushed = 1;
-        continue;
+    }
+    n = rv;
+    if ( in->remain >= 0 ) {
+      in->remain -= rv;
+    }
+    else {
+      ret = _decode_chunked(&in->decoder, raw, &n);
+      if ( ret == -1 ) {
+        rb_raise(rb_eIOError, "malformed chunked request body");
       }
+    }
+    in->total += n;
+    if ( in->max_size > 0 && in->total > in->max_size ) {
+      rb_raise(rb_eIOError, "request body too large");
+    }
+    rb_str_cat(in->buf, raw, n);
+    if ( in->rewindable && RSTRING_LEN(in->buf) > in->rewind_size ) {
+      in->rewindable = 0;
+    }
+  }
+  if ( in->remain == 0 || ret >= 0 ) {
+    in->eof = 1;
+    in->rest = rb_str_new(raw + n, ret >= 0 ? ret : 0);
+    rb_str_cat(in->rest, RSTRING_PTR(in->src) + in->src_off, RSTRING_LEN(in->src) - in->src_off);
+    in->src = rb_str_new(0, 0);
+    in->src_off = 0;
+  }
+  return 1;
+}
 
-      v[iovcnt].iov_base = key;
-      v[iovcnt].iov_len = key_len;
-      iovcnt++;
-      v[iovcnt].iov_base = ": ";
-      v[iovcnt].iov_len = sizeof(": ") - 1;
-      iovcnt++;
+static
+VALUE _input_take(struct rhe_input *in, long n, VALUE outbuf) {
+  if ( NIL_P(outbuf) ) {
+    outbuf = rb_str_new(RSTRING_PTR(in->buf) + in->pos, n);
+  }
+  else {
+    StringValue(outbuf);
+    rb_str_resize(outbuf, 0);
+    rb_str_cat(outbuf, RSTRING_PTR(in->buf) + in->pos, n);
+  }
+  in->pos += n;
+  return outbuf;
+}
 
-      // value
-      v[iovcnt].iov_base = RSTRING_PTR(val_obj);
-      v[iovcnt].iov_len = RSTRING_LEN(val_obj);
-      iovcnt++;
-      v[iovcnt].iov_base = "\r\n";
-      v[iovcnt].iov_len = sizeof("\r\n") - 1;
-      iovcnt++;
-    }
+/* read([length[, outbuf]]) */
+static
+VALUE rhe_input_read(int argc, VALUE *argv, VALUE self) {
+  struct rhe_input *in = _input(self);
+  VALUE lengthv, outbuf;
+  long length, avail;
 
-    if ( date_pushed == 0 ) {
-        v[1].iov_len = sizeof("Date: Sat, 19 Dec 2015 14:16:27 GMT\r\n") - 1;
-        v[1].iov_base = _date_header();
+  rb_scan_args(argc, argv, "02", &lengthv, &outbuf);
+  if ( NIL_P(lengthv) ) {
+    while ( _input_pull(in) );
+    return _input_take(in, RSTRING_LEN(in->buf) - in->pos, outbuf);
+  }
+  length = NUM2LONG(lengthv);
+  if ( length < 0 ) {
+    rb_raise(rb_eArgError, "negative length %ld given", length);
+  }
+  while ( (avail = RSTRING_LEN(in->buf) - in->pos) < length && _input_pull(in) );
+  if ( avail == 0 && length > 0 ) {
+    if ( !NIL_P(outbuf) ) {
+      rb_str_resize(StringValue(outbuf), 0);
     }
+    return Qnil;
+  }
+  return _input_take(in, avail < length ? avail : length, outbuf);
+}
 
-    if ( use_chunked ) {
-      v[iovcnt].iov_base = "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
-      v[iovcnt].iov_len = sizeof("Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n") - 1;
-      iovcnt++;
+static
+VALUE rhe_input_gets(VALUE self) {
+  struct rhe_input *in = _input(self);
+  const char *lf;
+  long scanned = 0;
+  long avail;
+
+  while ( 1 ) {
+    avail = RSTRING_LEN(in->buf) - in->pos;
+    lf = memchr(RSTRING_PTR(in->buf) + in->pos + scanned, '\n', avail - scanned);
+    if ( lf != NULL ) {
+      return _input_take(in, lf - (RSTRING_PTR(in->buf) + in->pos) + 1, Qnil);
     }
-    else {
-        v[iovcnt].iov_base = "Connection: close\r\n\r\n";
-        v[iovcnt].iov_len = sizeof("Connection: close\r\n\r\n") - 1;
-        iovcnt++;
+    scanned = avail;
+    if ( !_input_pull(in) ) {
+      break;
     }
+  }
+  if ( avail == 0 ) {
+    return Qnil;
+  }
+  return _input_take(in, avail, Qnil);
+}
 
-    ssize_t chb_offset = 0;
-    for ( i=0; i<blen; i++) {
-      val_obj = rb_String(rb_ary_entry(body, i));
-      if ( RSTRING_LEN(val_obj) == 0 ) {
-          continue;
-      }
-      if ( use_chunked ) {
-          v[iovcnt].iov_len = _chunked_header(&chunked_header_buf[chb_offset],RSTRING_LEN(val_obj));
-          v[iovcnt].iov_base = &chunked_header_buf[chb_offset];
-          chb_offset += v[iovcnt].iov_len;
-          iovcnt++;
-      }
-      v[iovcnt].iov_base = RSTRING_PTR(val_obj);
-      v[iovcnt].iov_len = RSTRING_LEN(val_obj);
-      iovcnt++;
-      if ( use_chunked ) {
-          v[iovcnt].iov_base = "\r\n";
-          v[iovcnt].iov_len = sizeof("\r\n") -1;
-          iovcnt++;
-      }
+static
+VALUE rhe_input_each(VALUE self) {
+  VALUE line;
+  RETURN_ENUMERATOR(self, 0, 0);
+  while ( !NIL_P(line = rhe_input_gets(self)) ) {
+    rb_yield(line);
+  }
+  return self;
+}
+
+static
+VALUE rhe_input_rewind(VALUE self) {
+  struct rhe_input *in = _input(self);
+  if ( !in->rewindable ) {
+    rb_raise(rb_eIOError, "rack.input can not be rewound after %ld bytes", in->rewind_size);
+  }
+  in->pos = 0;
+  return INT2FIX(0);
+}
+
+static
+VALUE rhe_input_eof_p(VALUE self) {
+  struct rhe_input *in = _input(self);
+  while ( RSTRING_LEN(in->buf) == in->pos ) {
+    if ( !_input_pull(in) ) {
+      return Qtrue;
+    }
+  }
+  return Qfalse;
+}
+
+/* bytes after the body, read with it. nil until the whole body was read */
+static
+VALUE rhe_input_rest(VALUE self) {
+  return _input(self)->rest;
+}
+
+struct input_drain {
+  struct rhe_input *in;
+  long max_bytes;
+  long long deadline;
+};
+
+static
+VALUE _input_drain(VALUE ptr) {
+  struct input_drain *d = (struct input_drain *)ptr;
+  struct rhe_input *in = d->in;
+  size_t start = in->total;
+  long long left;
+  in->rewindable = 0;
+  while ( !in->eof && (long)(in->total - start) < d->max_bytes ) {
+    left = d->deadline - _now_ns();
+    if ( left <= 0 ) {
+      break;
     }
-    if ( use_chunked && header_only == 0 ) {
-      v[iovcnt].iov_base = "0\r\n\r\n";
-      v[iovcnt].iov_len = sizeof("0\r\n\r\n") - 1;
-      iovcnt++;
+    if ( in->timeout > left / 1e9 ) {
+      in->timeout = left / 1e9;
     }
+    in->pos = RSTRING_LEN(in->buf);
+    _input_pull(in);
+  }
+  return Qnil;
+}
 
-    vec_offset = 0;
-    written = 0;
-    remain = iovcnt;
-    while ( remain > 0 ) {
-      count = (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt;
-      rv = _writev_timeout(fileno, timeout,  &v[vec_offset], count - vec_offset, (vec_offset == 0) ? 0 : 1);
-      if ( rv <= 0 ) {
-        // error or disconnected
-        break;
-      }
-      written += rv;
-      while ( rv > 0 ) {
-        if ( (unsigned int)rv >= v[vec_offset].iov_len ) {
-          rv -= v[vec_offset].iov_len;
-          vec_offset++;
-          remain--;
-        }
-        else {
-          v[vec_offset].iov_base = (char*)v[vec_offset].iov_base + rv;
-          v[vec_offset].iov_len -= rv;
-          rv = 0;
-        }
-      }
+/*
+ * drain(max_bytes, timeout)
+ * called after the response was written. stops sending and reads the body
+ * left by the app away, up to max_bytes more and timeout seconds, so that
+ * close does not reset the connection before the client got the response.
+ * returns true if the body ended
+ */
+static
+VALUE rhe_input_drain(VALUE self, VALUE max_bytesv, VALUE timeoutv) {
+  struct input_drain d;
+  int state = 0;
+  d.in = _input(self);
+  if ( d.in->eof ) {
+    return Qtrue;
+  }
+  d.max_bytes = NUM2LONG(max_bytesv);
+  d.deadline = _now_ns() + (long long)(NUM2DBL(timeoutv) * 1e9);
+  shutdown(d.in->fd, SHUT_WR);
+  rb_protect(_input_drain, (VALUE)&d, &state);
+  if ( state ) {
+    if ( !rb_obj_is_kind_of(rb_errinfo(), rb_eStandardError) ) {
+      rb_jump_tag(state);
     }
+    /* disconnected or malformed body. close anyway */
+    rb_set_errinfo(Qnil);
   }
-  if ( use_chunked )
-      xfree(chunked_header_buf);
-  if ( server_pushed )
-      xfree(server_line);
-  if ( date_pushed )
-      xfree(date_line);
-  if ( rv < 0 ) {
+  return d.in->eof ? Qtrue : Qfalse;
+}
+
+static
+VALUE rhe_input_close(VALUE self) {
+  return Qnil;
+}
+
+/* writes a response whose body is not an Array. parts yielded by body.each
+   are coalesced up to flush_size bytes, into one chunk if use_chunked */
+static
+VALUE rhe_stream_response(VALUE self, VALUE filenov, VALUE timeoutv, VALUE status_codev, VALUE headers, VALUE body, VALUE use_chunkedv, VALUE keepalivev, VALUE flush_sizev) {
+  struct stream_writer sw;
+
+  memset(&sw, 0, sizeof(sw));
+  sw.fd = NUM2INT(filenov);
+  sw.timeout = NUM2DBL(timeoutv);
+  sw.flush_size = NUM2LONG(flush_sizev);
+  sw.chunked = _out_response_head(&sw.rw, NUM2INT(status_codev), headers, Qnil, NUM2INT(use_chunkedv), NUM2INT(keepalivev));
+  sw.head_len = sw.rw.len - sw.rw.start;
+  sw.data_start = sw.rw.len + STREAM_CHUNK_ROOM;
+  _out_reserve(&sw.rw, STREAM_CHUNK_ROOM);
+  sw.rw.len = sw.data_start;
+
+  rb_block_call(body, id_each, 0, NULL, _stream_part_i, (VALUE)&sw);
+  if ( sw.failed || _stream_flush(&sw, Qnil, 1) < 0 ) {
     return Qnil;
   }
-  return SSIZET2NUM(written);
+  return SSIZET2NUM(sw.written);
 }
 
 void Init_rhebok()
@@ -1053,29 +4555,159 @@ void Init_rhebok()
   http11_val = rb_obj_freeze(rb_str_new2("HTTP/1.1"));
   rb_gc_register_address(&http11_val);
 
+  _init_simd();
+  _init_status_lines();
+
+  set_common_method("GET", sizeof("GET") - 1);
+  set_common_method("POST", sizeof("POST") - 1);
+  set_common_method("HEAD", sizeof("HEAD") - 1);
+  set_common_method("PUT", sizeof("PUT") - 1);
+  set_common_method("DELETE", sizeof("DELETE") - 1);
+  set_common_method("OPTIONS", sizeof("OPTIONS") - 1);
+  set_common_method("PATCH", sizeof("PATCH") - 1);
+
   expect_key = rb_obj_freeze(rb_str_new2("HTTP_EXPECT"));
   rb_gc_register_address(&expect_key);
 
-  set_common_header("HOST",sizeof("HOST") - 1, 0);
+  set_common_header("HOST",sizeof("HOST") - 1, COMMON_HEADER_EAGER);
   set_common_header("ACCEPT",sizeof("ACCEPT") - 1, 0);
+  set_common_header("ACCEPT-CHARSET",sizeof("ACCEPT-CHARSET") - 1, 0);
   set_common_header("ACCEPT-ENCODING",sizeof("ACCEPT-ENCODING") - 1, 0);
   set_common_header("ACCEPT-LANGUAGE",sizeof("ACCEPT-LANGUAGE") - 1, 0);
+  set_common_header("AUTHORIZATION",sizeof("AUTHORIZATION") - 1, 0);
   set_common_header("CACHE-CONTROL",sizeof("CACHE-CONTROL") - 1, 0);
-  set_common_header("CONNECTION",sizeof("CONNECTION") - 1, 0);
-  set_common_header("CONTENT-LENGTH",sizeof("CONTENT-LENGTH") - 1, 1);
-  set_common_header("CONTENT-TYPE",sizeof("CONTENT-TYPE") - 1, 1);
+  set_common_header("CDN-LOOP",sizeof("CDN-LOOP") - 1, 0);
+  set_common_header("CONNECTION",sizeof("CONNECTION") - 1, COMMON_HEADER_EAGER);
+  set_common_header("CONTENT-LENGTH",sizeof("CONTENT-LENGTH") - 1, COMMON_HEADER_RAW);
+  set_common_header("CONTENT-TYPE",sizeof("CONTENT-TYPE") - 1, COMMON_HEADER_RAW);
   set_common_header("COOKIE",sizeof("COOKIE") - 1, 0);
+  set_common_header("DNT",sizeof("DNT") - 1, 0);
+  set_common_header("EXPECT",sizeof("EXPECT") - 1, COMMON_HEADER_EAGER);
+  set_common_header("FORWARDED",sizeof("FORWARDED") - 1, 0);
+  set_common_header("IF-MATCH",sizeof("IF-MATCH") - 1, 0);
   set_common_header("IF-MODIFIED-SINCE",sizeof("IF-MODIFIED-SINCE") - 1, 0);
+  set_common_header("IF-NONE-MATCH",sizeof("IF-NONE-MATCH") - 1, 0);
+  set_common_header("IF-RANGE",sizeof("IF-RANGE") - 1, 0);
+  set_common_header("IF-UNMODIFIED-SINCE",sizeof("IF-UNMODIFIED-SINCE") - 1, 0);
+  set_common_header("ORIGIN",sizeof("ORIGIN") - 1, 0);
+  set_common_header("PRAGMA",sizeof("PRAGMA") - 1, 0);
+  set_common_header("RANGE",sizeof("RANGE") - 1, 0);
   set_common_header("REFERER",sizeof("REFERER") - 1, 0);
+  set_common_header("SEC-CH-UA",sizeof("SEC-CH-UA") - 1, 0);
+  set_common_header("SEC-CH-UA-MOBILE",sizeof("SEC-CH-UA-MOBILE") - 1, 0);
+  set_common_header("SEC-CH-UA-PLATFORM",sizeof("SEC-CH-UA-PLATFORM") - 1, 0);
+  set_common_header("SEC-FETCH-DEST",sizeof("SEC-FETCH-DEST") - 1, 0);
+  set_common_header("SEC-FETCH-MODE",sizeof("SEC-FETCH-MODE") - 1, 0);
+  set_common_header("SEC-FETCH-SITE",sizeof("SEC-FETCH-SITE") - 1, 0);
+  set_common_header("SEC-FETCH-USER",sizeof("SEC-FETCH-USER") - 1, 0);
+  set_common_header("TE",sizeof("TE") - 1, 0);
+  set_common_header("TRACEPARENT",sizeof("TRACEPARENT") - 1, 0);
+  set_common_header("TRACESTATE",sizeof("TRACESTATE") - 1, 0);
+  set_common_header("TRANSFER-ENCODING",sizeof("TRANSFER-ENCODING") - 1, COMMON_HEADER_EAGER);
+  set_common_header("UPGRADE",sizeof("UPGRADE") - 1, 0);
+  set_common_header("UPGRADE-INSECURE-REQUESTS",sizeof("UPGRADE-INSECURE-REQUESTS") - 1, 0);
   set_common_header("USER-AGENT",sizeof("USER-AGENT") - 1, 0);
+  set_common_header("VIA",sizeof("VIA") - 1, 0);
+  set_common_header("X-AMZN-TRACE-ID",sizeof("X-AMZN-TRACE-ID") - 1, 0);
+  set_common_header("X-CSRF-TOKEN",sizeof("X-CSRF-TOKEN") - 1, 0);
   set_common_header("X-FORWARDED-FOR",sizeof("X-FORWARDED-FOR") - 1, 0);
+  set_common_header("X-FORWARDED-HOST",sizeof("X-FORWARDED-HOST") - 1, 0);
+  set_common_header("X-FORWARDED-PORT",sizeof("X-FORWARDED-PORT") - 1, 0);
+  set_common_header("X-FORWARDED-PROTO",sizeof("X-FORWARDED-PROTO") - 1, 0);
+  set_common_header("X-FORWARDED-SSL",sizeof("X-FORWARDED-SSL") - 1, 0);
+  set_common_header("X-REAL-IP",sizeof("X-REAL-IP") - 1, 0);
+  set_common_header("X-REQUEST-ID",sizeof("X-REQUEST-ID") - 1, 0);
+  set_common_header("X-REQUEST-START",sizeof("X-REQUEST-START") - 1, 0);
+  set_common_header("X-REQUESTED-WITH",sizeof("X-REQUESTED-WITH") - 1, 0);
+
+  id_print = rb_intern("print");
+  sym_heap_live_slots = ID2SYM(rb_intern("heap_live_slots"));
+  sym_heap_free_slots = ID2SYM(rb_intern("heap_free_slots"));
+  sym_malloc_increase_bytes = ID2SYM(rb_intern("malloc_increase_bytes"));
+  sym_malloc_increase_bytes_limit = ID2SYM(rb_intern("malloc_increase_bytes_limit"));
+  sym_old_objects = ID2SYM(rb_intern("old_objects"));
+  sym_old_objects_limit = ID2SYM(rb_intern("old_objects_limit"));
+  sym_oldmalloc_increase_bytes = ID2SYM(rb_intern("oldmalloc_increase_bytes"));
+  sym_oldmalloc_increase_bytes_limit = ID2SYM(rb_intern("oldmalloc_increase_bytes_limit"));
+  sym_minor = ID2SYM(rb_intern("minor"));
+  sym_major = ID2SYM(rb_intern("major"));
+  sym_full_mark = ID2SYM(rb_intern("full_mark"));
+  sym_immediate_sweep = ID2SYM(rb_intern("immediate_sweep"));
+  id_each = rb_intern("each");
+  id_header_buf = rb_intern("__rhebok_header_buf");
+  /* no @, hidden from instance_variables */
+  id_lazy_headers = rb_intern("__rhebok_lazy_headers");
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  id_for_fd = rb_intern("for_fd");
+  for_fd_opts = rb_hash_new();
+  rb_hash_aset(for_fd_opts, ID2SYM(rb_intern("autoclose")), Qfalse);
+  rb_obj_freeze(for_fd_opts);
+  rb_gc_register_address(&for_fd_opts);
+  wait_ios = rb_ary_new();
+  rb_gc_register_address(&wait_ios);
+#endif
 
   cRhebok = rb_const_get(rb_cObject, rb_intern("Rhebok"));
   rb_define_module_function(cRhebok, "accept_rack", rhe_accept, 4);
+  rb_define_module_function(cRhebok, "read_rack", rhe_read_rack, 7);
+  rb_define_module_function(cRhebok, "max_header_size=", rhe_set_max_header_size, 1);
+  rb_define_module_function(cRhebok, "exclusive_accept=", rhe_set_exclusive_accept, 1);
+  rb_define_module_function(cRhebok, "cpu_affinity", rhe_cpu_affinity, 0);
+  rb_define_module_function(cRhebok, "cpu_affinity=", rhe_set_cpu_affinity, 1);
+  rb_define_module_function(cRhebok, "numa_preferred_node=", rhe_set_numa_preferred_node, 1);
+  rb_define_module_function(cRhebok, "scoreboard_create", rhe_scoreboard_create, 1);
+  rb_define_module_function(cRhebok, "scoreboard_slot=", rhe_set_scoreboard_slot, 1);
+  rb_define_module_function(cRhebok, "scoreboard", rhe_scoreboard, 0);
+  rb_define_module_function(cRhebok, "proc_rss", rhe_proc_rss, 1);
+  rb_define_module_function(cRhebok, "proc_pss", rhe_proc_pss, 1);
+  rb_define_module_function(cRhebok, "metrics=", rhe_set_metrics, 1);
+  rb_define_module_function(cRhebok, "metrics", rhe_metrics, 0);
+  rb_define_module_function(cRhebok, "oob_gc", rhe_oob_gc, 0);
+  rb_define_module_function(cRhebok, "adaptive_oob_gc", rhe_adaptive_oob_gc, 2);
+  rb_define_module_function(cRhebok, "io_uring=", rhe_set_io_uring, 1);
+  rb_define_module_function(cRhebok, "multishot_accept=", rhe_set_multishot_accept, 1);
+  rb_define_module_function(cRhebok, "queued_connections", rhe_queued_connections, 0);
+  rb_define_module_function(cRhebok, "listen_queue", rhe_listen_queue, 1);
+  rb_define_module_function(cRhebok, "lazy_env=", rhe_set_lazy_env, 1);
+  rb_define_module_function(cRhebok, "lazy_header", rhe_lazy_header, 2);
+  rb_define_module_function(cRhebok, "materialize_env", rhe_materialize_env, 1);
+#ifdef USE_EXCLUSIVE_ACCEPT
+  rb_define_const(cRhebok, "EXCLUSIVE_ACCEPT", Qtrue);
+#else
+  rb_define_const(cRhebok, "EXCLUSIVE_ACCEPT", Qfalse);
+#endif
   rb_define_module_function(cRhebok, "read_timeout", rhe_read_timeout, 5);
+  rb_define_module_function(cRhebok, "read_chunked", rhe_read_chunked, 5);
+  rb_define_module_function(cRhebok, "read_body", rhe_read_body, 5);
   rb_define_module_function(cRhebok, "write_timeout", rhe_write_timeout, 5);
   rb_define_module_function(cRhebok, "write_all", rhe_write_all, 4);
   rb_define_module_function(cRhebok, "write_chunk", rhe_write_chunk, 4);
+  rb_define_module_function(cRhebok, "sendfile", rhe_sendfile, 5);
   rb_define_module_function(cRhebok, "close_rack", rhe_close, 1);
-  rb_define_module_function(cRhebok, "write_response", rhe_write_response, 7);
+  rb_define_module_function(cRhebok, "write_response", rhe_write_response, 8);
+  rb_define_module_function(cRhebok, "stream_response", rhe_stream_response, 8);
+  cInput = rb_define_class_under(cRhebok, "Input", rb_cObject);
+  rb_define_alloc_func(cInput, _input_alloc);
+  rb_define_method(cInput, "initialize", rhe_input_initialize, 6);
+  rb_define_method(cInput, "read", rhe_input_read, -1);
+  rb_define_method(cInput, "gets", rhe_input_gets, 0);
+  rb_define_method(cInput, "each", rhe_input_each, 0);
+  rb_define_method(cInput, "rewind", rhe_input_rewind, 0);
+  rb_define_method(cInput, "eof?", rhe_input_eof_p, 0);
+  rb_define_method(cInput, "rest", rhe_input_rest, 0);
+  rb_define_method(cInput, "drain", rhe_input_drain, 2);
+  rb_define_method(cInput, "close", rhe_input_close, 0);
+  cSpillBuffer = rb_define_class_under(cRhebok, "SpillBuffer", rb_cObject);
+  rb_define_alloc_func(cSpillBuffer, _spill_alloc);
+  rb_define_method(cSpillBuffer, "initialize", rhe_spill_initialize, 2);
+  rb_define_method(cSpillBuffer, "print", rhe_spill_print, 1);
+  rb_define_method(cSpillBuffer, "<<", rhe_spill_print, 1);
+  rb_define_method(cSpillBuffer, "size", rhe_spill_size, 0);
+  rb_define_method(cSpillBuffer, "spilled?", rhe_spill_spilled_p, 0);
+  rb_define_method(cSpillBuffer, "read", rhe_spill_read, -1);
+  rb_define_method(cSpillBuffer, "gets", rhe_spill_gets, 0);
+  rb_define_method(cSpillBuffer, "each", rhe_spill_each, 0);
+  rb_define_method(cSpillBuffer, "rewind", rhe_spill_rewind, 0);
+  rb_define_method(cSpillBuffer, "eof?", rhe_spill_eof_p, 0);
+  rb_define_method(cSpillBuffer, "close", rhe_spill_close, 0);
 }
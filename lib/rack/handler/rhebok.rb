@@ -12,6 +12,7 @@ require 'prefork_engine'
 require 'rhebok'
 require 'rhebok/config'
 require 'rhebok/buffered'
+require 'rhebok/scaling_engine'
 
 $RACK_HANDLER_RHEBOK_GCTOOL = true
 begin
@@ -24,6 +25,9 @@ module Rack
   module Handler
     class Rhebok
       MAX_MEMORY_BUFFER_SIZE = 1024 * 1024
+      # limits for reading away a body the app did not read
+      DRAIN_BODY_SIZE = 4 * 1024 * 1024
+      DRAIN_BODY_TIMEOUT = 2
       DEFAULT_OPTIONS = {
         :Host => '0.0.0.0',
         :Port => 9292,
@@ -37,13 +41,46 @@ module Rack
         :OobGC => false,
         :MaxGCPerRequest => 5,
         :MinGCPerRequest => nil,
+        :AdaptiveOobGC => false,
+        :OobGCBudget => 0.05,
         :BackLog => Socket::SOMAXCONN,
         :BeforeFork => nil,
         :AfterFork => nil,
+        :Preload => false,
+        :Warmup => nil,
         :ReusePort => false,
         :ChunkedTransfer => false,
+        :KeepAlive => false,
+        :KeepAliveTimeout => 1,
+        :MaxKeepAliveRequests => 100,
+        :MaxRequestBodySize => 0,
+        :MaxHeaderSize => 16384,
+        :Threads => 1,
+        :FiberScheduler => nil,
+        :Fibers => 100,
+        :ExclusiveAccept => false,
+        :ReusePortPerWorker => false,
+        :IOUring => false,
+        :CPUAffinity => nil,
+        :StatusPath => nil,
+        :MetricsPath => nil,
+        :LazyEnv => false,
+        :StreamBufferSize => 0,
+        :StreamingInput => false,
+        :MaxMemoryBufferSize => MAX_MEMORY_BUFFER_SIZE,
+        :MinWorkers => nil,
+        :MinSpareWorkers => 1,
+        :MaxSpareWorkers => 4,
+        :ScaleDownDelay => 10,
+        :MemoryLimit => 0,
+        :HardMemoryLimit => 0,
+        :MemoryLimitPSS => false,
+        :MemoryCheckInterval => 10,
       }
       NULLIO  = StringIO.new("").set_encoding('BINARY')
+      ENTITY_TOO_LARGE = "HTTP/1.1 413 Request Entity Too Large\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nRequest Entity Too Large\r\n"
+      # builds a header deferred by LazyEnv when the app first reads it
+      LAZY_HEADER = proc { |env, key| ::Rhebok.lazy_header(env, key) }
 
       def self.run(app, options={})
         slf = new(options)
@@ -62,12 +99,39 @@ module Rack
         if options[:OobGC].instance_of?(String)
           options[:OobGC] = options[:OobGC].match(/^(true|yes|1)$/i) ? true : false
         end
+        if options[:MemoryLimitPSS].instance_of?(String)
+          options[:MemoryLimitPSS] = options[:MemoryLimitPSS].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:Preload].instance_of?(String)
+          options[:Preload] = options[:Preload].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:AdaptiveOobGC].instance_of?(String)
+          options[:AdaptiveOobGC] = options[:AdaptiveOobGC].match(/^(true|yes|1)$/i) ? true : false
+        end
         if options[:ReusePort].instance_of?(String)
           options[:ReusePort] = options[:ReusePort].match(/^(true|yes|1)$/i) ? true : false
         end
         if options[:ChunkedTransfer].instance_of?(String)
           options[:ChunkedTransfer] = options[:ChunkedTransfer].match(/^(true|yes|1)$/i) ? true : false
         end
+        if options[:KeepAlive].instance_of?(String)
+          options[:KeepAlive] = options[:KeepAlive].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:ExclusiveAccept].instance_of?(String)
+          options[:ExclusiveAccept] = options[:ExclusiveAccept].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:ReusePortPerWorker].instance_of?(String)
+          options[:ReusePortPerWorker] = options[:ReusePortPerWorker].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:IOUring].instance_of?(String)
+          options[:IOUring] = options[:IOUring].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:LazyEnv].instance_of?(String)
+          options[:LazyEnv] = options[:LazyEnv].match(/^(true|yes|1)$/i) ? true : false
+        end
+        if options[:StreamingInput].instance_of?(String)
+          options[:StreamingInput] = options[:StreamingInput].match(/^(true|yes|1)$/i) ? true : false
+        end
 
         @options = DEFAULT_OPTIONS.merge(options)
         if @options[:ConfigFile] != nil
@@ -79,6 +143,11 @@ module Rack
         @server = nil
         @_is_tcp = false
         @_using_defer_accept = false
+        @_worker_listener = false
+        @_cpu_sets = nil
+        @_worker_slot = 0
+        @_incoming_cpu = nil
+        @_scoreboard = false
       end
 
       def setup_listener()
@@ -119,26 +188,92 @@ module Rack
             @server = Socket.new(defined?(Socket::AF_INET6) && addrinfo.afamily == Socket::AF_INET6 ?
                                  Socket::AF_INET6 : Socket::AF_INET, Socket::SOCK_STREAM, 0)
             @server.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEADDR, 1)
-            if @options[:ReusePort]
+            if @options[:ReusePort] || @options[:ReusePortPerWorker]
               @server.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEPORT, 1);
             end
             @server.bind(addrinfo)
             @_is_tcp = true
+            # each worker listens on its own socket. master only holds the port
+            @_worker_listener = @options[:ReusePortPerWorker] ? true : false
           end
-          @server.listen(@options[:BackLog].to_i)
+          @server.listen(@options[:BackLog].to_i) if !@_worker_listener
         end # @server == nil
 
+        if @options[:ReusePortPerWorker] && !@_worker_listener
+          puts "ReusePortPerWorker is only available for TCP socket bound by Rhebok. disabled"
+        end
+
+        if @options[:ExclusiveAccept] && !::Rhebok::EXCLUSIVE_ACCEPT
+          puts "ExclusiveAccept is not supported on this platform. disabled"
+          @options[:ExclusiveAccept] = false
+        end
+
+        self._setup_listen_options(@server)
+      end
+
+      def _setup_listen_options(sock)
         if RUBY_PLATFORM.match(/linux/) && @_is_tcp == true
           begin
-            @server.setsockopt(Socket::IPPROTO_TCP, 9, 1)
+            sock.setsockopt(Socket::IPPROTO_TCP, 9, 1)
             @_using_defer_accept = true
           end
         end
 
-        if @server.respond_to?("autoclose=")
-          @server.autoclose = false
+        if sock.respond_to?("autoclose=")
+          sock.autoclose = false
         end
 
+        # accept_rack waits in blocking accept(2). sockets are nonblocking by default since ruby 3.0
+        # in fiber mode or with ExclusiveAccept, accept waits in the fiber scheduler or epoll instead
+        if sock.respond_to?("nonblock=")
+          sock.nonblock = @options[:FiberScheduler] || @options[:ExclusiveAccept] ? true : false
+        end
+      end
+
+      def _open_worker_listener
+        addrinfo = @server.local_address
+        sock = Socket.new(addrinfo.afamily, Socket::SOCK_STREAM, 0)
+        sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEADDR, 1)
+        sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEPORT, 1)
+        sock.bind(addrinfo)
+        sock.listen(@options[:BackLog].to_i)
+        self._setup_listen_options(sock)
+        if @_incoming_cpu && defined?(Socket::SO_INCOMING_CPU)
+          # prefer this worker's listener for connections processed on its CPU
+          sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_INCOMING_CPU, @_incoming_cpu)
+        end
+        @server = sock
+      end
+
+      def _drain_listener(app, env_template)
+        # connections queued on worker's own listener are reset when it is
+        # closed. take only the ones queued now and close the listener, so
+        # that new connections go to other workers, then serve them
+        ::Rhebok.multishot_accept = false
+        fileno = @server.fileno
+        pending = []
+        queue = ::Rhebok.listen_queue(fileno)
+        (queue ? queue[0] : @options[:BackLog].to_i).times do
+          accepted = @server.accept_nonblock(exception: false)
+          break unless accepted.instance_of?(Array)
+          accepted[0].autoclose = false
+          pending << accepted
+        end
+        @server.close
+        # accepted by io_uring before multishot accept stopped
+        while ::Rhebok.queued_connections > 0
+          connection, buf, env = ::Rhebok.accept_rack(fileno, @options[:Timeout], @_is_tcp, env_template)
+          self._serve_connection(app, connection, buf, env, env_template) if connection
+        end
+        pending.each do |sock, addr|
+          connection = sock.fileno
+          buf, env = ::Rhebok.read_rack(connection, "", @options[:Timeout], @options[:Timeout], env_template, addr.ip_address, addr.ip_port.to_s)
+          if buf == nil
+            ::Rhebok.close_rack(connection)
+            next
+          end
+          self._serve_connection(app, connection, buf, env, env_template)
+        end
       end
 
       def run_worker(app)
@@ -156,17 +291,45 @@ module Rack
         if @options[:ErrRespawnInterval]
           pm_args["err_respawn_interval"] = @options[:ErrRespawnInterval].to_i
         end
-        if @options[:BeforeFork]
+        # with Preload, BeforeFork is called once by _preload
+        if @options[:BeforeFork] && !@options[:Preload]
           pm_args["before_fork"] = proc { |pe2|
             @options[:BeforeFork].call
           }
         end
+        if @options[:CPUAffinity]
+          @_cpu_sets = self._cpu_sets(@options[:CPUAffinity])
+        end
+        @_scoreboard = @options[:StatusPath] || @options[:MetricsPath] || @options[:MinWorkers] ? true : false
+        if @_scoreboard
+          # room for workers still finishing requests after a restart
+          ::Rhebok.scoreboard_create(@options[:MaxWorkers].to_i * 2)
+          ::Rhebok.metrics = @options[:MetricsPath] ? true : false
+        end
+        if @options[:CPUAffinity] || @_scoreboard
+          self._setup_worker_slots(pm_args)
+        end
+        self._watch_worker_memory(pm_args) if @options[:HardMemoryLimit].to_i > 0
+        self._preload(app) if @options[:Preload]
         Signal.trap('INT','SYSTEM_DEFAULT') # XXX
 
-        pe = PreforkEngine.new(pm_args)
+        if @options[:MinWorkers]
+          pe = ::Rhebok::ScalingEngine.new(pm_args, {
+            "min_workers" => @options[:MinWorkers].to_i,
+            "min_spare_workers" => @options[:MinSpareWorkers].to_i,
+            "max_spare_workers" => @options[:MaxSpareWorkers].to_i,
+            "scale_down_delay" => @options[:ScaleDownDelay].to_f,
+            # each worker has its own queue with ReusePortPerWorker
+            "listen_fileno" => @_worker_listener ? nil : @server.fileno,
+          })
+        else
+          pe = PreforkEngine.new(pm_args)
+        end
         while !pe.signal_received.match(/^(TERM|USR1)$/)
           pe.start do
             srand
+            self._pin_worker if @_cpu_sets
+            ::Rhebok.scoreboard_slot = @_worker_slot if @_scoreboard
             if @options[:AfterFork]
               @options[:AfterFork].call
             end
@@ -179,6 +342,125 @@ module Rack
         end
       end
 
+      # warm the app and settle the heap in the master, so workers share its
+      # pages until they write to them ("nakayoshi fork")
+      def _preload(app)
+        @options[:Warmup].call(app) if @options[:Warmup]
+        # connections opened while warming are not inherited by workers. the
+        # master does not use them after forking starts, so this runs only once
+        @options[:BeforeFork].call if @options[:BeforeFork]
+        if ::Process.respond_to?(:warmup)
+          # full GC, compaction and promotion of all survivors to old generation
+          ::Process.warmup
+        else
+          # objects surviving 3 GCs are old and not marked again by minor GCs
+          4.times { GC.start(full_mark: true, immediate_sweep: true) }
+          begin
+            GC.compact
+          rescue NotImplementedError, NoMethodError
+          end
+        end
+      end
+
+      def _worker_memory(pid)
+        @options[:MemoryLimitPSS] ? ::Rhebok.proc_pss(pid) : ::Rhebok.proc_rss(pid)
+      end
+
+      # workers over HardMemoryLimit can not finish requests. the master kills
+      # them from a thread while PreforkEngine waits for children
+      def _watch_worker_memory(pm_args)
+        limit = @options[:HardMemoryLimit].to_i
+        pids = {}
+        after_fork = pm_args["after_fork"]
+        pm_args["after_fork"] = proc { |pe2, pid|
+          after_fork.call(pe2, pid) if after_fork
+          pids[pid] = true
+        }
+        Thread.new do
+          while true
+            sleep 1
+            pids.keys.each do |pid|
+              memory = self._worker_memory(pid)
+              if memory == nil
+                pids.delete(pid)
+              elsif memory > limit
+                puts "worker #{pid} uses #{memory / 1024}KB over HardMemoryLimit. killed"
+                ::Process.kill(:KILL, pid) rescue nil
+                pids.delete(pid)
+              end
+            end
+          end
+        end
+      end
+
+      # worker slot is the lowest index not used by living workers, so a
+      # respawned worker takes over the CPUs of the one it replaces
+      def _setup_worker_slots(pm_args)
+        @_worker_slots = {}
+        @_worker_slot = 0
+        before_fork = pm_args["before_fork"]
+        pm_args["before_fork"] = proc { |pe2|
+          before_fork.call(pe2) if before_fork
+          @_worker_slots.delete_if { |pid, slot| !(Process.kill(0, pid) rescue false) }
+          @_worker_slot = (0..@_worker_slots.size).find { |i| !@_worker_slots.value?(i) }
+        }
+        pm_args["after_fork"] = proc { |pe2, pid|
+          @_worker_slots[pid] = @_worker_slot
+        }
+      end
+
+      # list of [cpus, numa node] to place workers on
+      def _cpu_sets(spec)
+        allowed = ::Rhebok.cpu_affinity
+        nodes = {}
+        Dir.glob("/sys/devices/system/node/node[0-9]*").each do |dir|
+          cpus = self._parse_cpu_list(::File.read("#{dir}/cpulist")) & allowed
+          nodes[dir[/\d+\z/].to_i] = cpus if !cpus.empty?
+        end
+        nodes = { nil => allowed } if nodes.empty?
+        node_of = {}
+        nodes.each { |node, cpus| cpus.each { |cpu| node_of[cpu] = node } }
+
+        case spec.to_s
+        when "node"
+          nodes.sort_by { |node, cpus| node.to_i }.map { |node, cpus| [cpus, node] }
+        when "true", "yes", "1", "cpu"
+          # consecutive workers go to different nodes
+          lists = nodes.sort_by { |node, cpus| node.to_i }.map { |node, cpus| cpus.dup }
+          sets = []
+          while lists.any? { |cpus| !cpus.empty? }
+            lists.each { |cpus| cpu = cpus.shift; sets << [[cpu], node_of[cpu]] if cpu }
+          end
+          sets
+        else
+          self._parse_cpu_list(spec.to_s).map { |cpu| [[cpu], node_of[cpu]] }
+        end
+      end
+
+      def _parse_cpu_list(list)
+        list.strip.split(",").map { |range|
+          first, last = range.split("-", 2).map(&:to_i)
+          (first..(last || first)).to_a
+        }.flatten
+      end
+
+      def _pin_worker
+        return if @_cpu_sets.empty?
+        cpus, node = @_cpu_sets[@_worker_slot % @_cpu_sets.size]
+        begin
+          ::Rhebok.cpu_affinity = cpus
+        rescue SystemCallError, NotImplementedError => e
+          puts "failed to set CPU affinity to #{cpus.join(",")}: #{e.message}"
+          return
+        end
+        # pinned worker allocates from its own node. pages shared with master stay where they are
+        begin
+          ::Rhebok.numa_preferred_node = node if node && @_cpu_sets.map { |c, n| n }.uniq.size > 1
+        rescue SystemCallError, NotImplementedError
+        end
+        @_incoming_cpu = cpus.size == 1 ? cpus.first : nil
+      end
+
       def _calc_reqs_per_child
         if @options[:MinRequestPerChild] == nil
           return @options[:MaxRequestPerChild].to_i
@@ -206,96 +488,268 @@ module Rack
       end
 
 
+      def _keepalive_response?(env, status_code, headers, body, use_chunked)
+        if headers.key?("Connection") && headers["Connection"] =~ /\bclose\b/i
+          return false
+        end
+        if status_code < 200 || status_code == 204 || status_code == 304 ||
+           headers.key?("Content-Length") || use_chunked == 1
+          return true
+        end
+        # Content-Length of Array body is counted by write_response
+        body.instance_of?(Array) && env["REQUEST_METHOD"] != "HEAD"
+      end
+
+      # [offset, length] to sendfile for a 200 or a single range 206. nil for
+      # other statuses, multipart/byteranges and ranges outside the file,
+      # then the body is streamed with each
+      def _file_range(status_code, headers, size)
+        return [0, size] if status_code == 200
+        return nil if status_code != 206 || !headers.key?("Content-Range")
+        return nil if headers.key?("Content-Type") && headers["Content-Type"] =~ /\Amultipart\//i
+        m = headers["Content-Range"].match(/\Abytes (\d+)-(\d+)\/(?:\d+|\*)\z/)
+        return nil if m == nil
+        first = m[1].to_i
+        last = m[2].to_i
+        return nil if first > last || last >= size
+        [first, last - first + 1]
+      end
+
       def accept_loop(app)
         @term_received = 0
-        proc_req_count = 0
+        @proc_req_count = 0
+        @gc_req_count = 0
+        @memory_check_count = 0
         Signal.trap(:TERM) do
           @term_received += 1
         end
         Signal.trap(:PIPE, "IGNORE")
-        max_reqs = self._calc_reqs_per_child()
-        gc_reqs = self._calc_gc_per_req()
-        fileno = @server.fileno
+        @max_reqs = self._calc_reqs_per_child()
+        @gc_reqs = self._calc_gc_per_req()
+        threads = @options[:Threads].to_i
 
         env_template = {
           "SERVER_NAME"       => @options[:Host],
           "SERVER_PORT"       => @options[:Port].to_s,
           "rack.version"      => [1,1],
           "rack.errors"       => STDERR,
-          "rack.multithread"  => false,
+          "rack.multithread"  => threads > 1 || @options[:FiberScheduler] != nil,
           "rack.multiprocess" => true,
           "rack.run_once"     => false,
           "rack.url_scheme"   => "http",
           "rack.input"        => NULLIO
-        }
+        }.freeze
+        ::Rhebok.max_header_size = @options[:MaxHeaderSize].to_i
+        ::Rhebok.exclusive_accept = @options[:ExclusiveAccept] ? true : false
+        ::Rhebok.lazy_env = @options[:LazyEnv] ? true : false
+        self._open_worker_listener if @_worker_listener
+        self._setup_io_uring(threads) if @options[:IOUring]
+
+        if threads > 1
+          self._run_threads(app, env_template, threads)
+        elsif @options[:FiberScheduler]
+          self._serve_fibers(app, env_template)
+        else
+          self._serve(app, env_template)
+        end
+        self._drain_listener(app, env_template) if @_worker_listener
+        ::Rhebok.scoreboard_slot = nil if @_scoreboard
+        exit!(true) if @term_received > 0
+      end
+
+      def _setup_io_uring(threads)
+        ::Rhebok.io_uring = true
+        # one multishot accept keeps taking connections while this worker is busy.
+        # only for a listener no other worker shares
+        ::Rhebok.multishot_accept = @_worker_listener && threads <= 1 && !@options[:FiberScheduler]
+      rescue NotImplementedError => e
+        puts "#{e.message}. IOUring disabled"
+        @options[:IOUring] = false
+      end
+
+      def _run_threads(app, env_template, threads)
+        workers = Array.new(threads) do
+          Thread.new {
+            if @options[:FiberScheduler]
+              self._serve_fibers(app, env_template)
+            else
+              self._serve(app, env_template)
+            end
+          }
+        end
+        # signals are handled by main thread. other threads finish
+        # current connection, and ones waiting in accept are stopped here
+        until workers.all? { |th| th.join(1) }
+          next if @term_received == 0
+          workers.each { |th| th.kill if th[:rhebok_accepting] }
+        end
+      end
 
-        while @options[:MaxRequestPerChild].to_i == 0 || proc_req_count < max_reqs
+      def _fiber_scheduler
+        scheduler = @options[:FiberScheduler]
+        if scheduler.instance_of?(String)
+          scheduler = Object.const_get(scheduler)
+        end
+        scheduler.respond_to?(:call) ? scheduler.call : scheduler.new
+      end
+
+      def _serve_fibers(app, env_template)
+        if !Fiber.respond_to?(:set_scheduler)
+          raise ArgumentError, "FiberScheduler requires ruby 3.0 or later"
+        end
+        Fiber.set_scheduler(self._fiber_scheduler)
+        # each fiber accepts and serves connections. socket waits in
+        # Rhebok yield to the scheduler, and accept wakes up every second
+        # to check signals and request count
+        @options[:Fibers].to_i.times do
+          Fiber.schedule { self._serve(app, env_template) }
+        end
+      ensure
+        # runs the scheduler until all fibers finish
+        Fiber.set_scheduler(nil) if Fiber.respond_to?(:set_scheduler)
+      end
+
+      def _serve(app, env_template)
+        fileno = @server.fileno
+        max_reqs = @max_reqs
+
+        while @options[:MaxRequestPerChild].to_i == 0 || @proc_req_count < max_reqs
           if @term_received > 0
-            exit!(true)
+            break
+          end
+          Thread.current[:rhebok_accepting] = true
+          connection, buf, env = ::Rhebok.accept_rack(fileno, @options[:Timeout], @_is_tcp, env_template)
+          Thread.current[:rhebok_accepting] = false
+          self._serve_connection(app, connection, buf, env, env_template) if connection
+        end #while max_reqs
+      end #def
+
+      # served before the app, like mod_status
+      def _status_response
+        workers = ::Rhebok.scoreboard
+        busy = workers.count { |w| w["state"] != "idle" }
+        lines = []
+        lines << "Workers: #{workers.size} Busy: #{busy} Idle: #{workers.size - busy}"
+        lines << "Requests: #{workers.inject(0) { |sum, w| sum + w["requests"] }}"
+        lines << ""
+        lines << "%-5s %-8s %-8s %10s %10s %10s %10s  %s" % ["Slot", "PID", "State", "Requests", "RSS(KB)", "PSS(KB)", "Elapsed", "Request"]
+        workers.each do |w|
+          busy = w["state"] != "idle"
+          pss = ::Rhebok.proc_pss(w["pid"])
+          lines << "%-5d %-8d %-8s %10d %10d %10s %10s  %s" % [w["slot"], w["pid"], w["state"], w["requests"], w["rss"] / 1024,
+                                                               pss ? pss / 1024 : "-",
+                                                               busy ? "%.3f" % w["elapsed"] : "-",
+                                                               busy ? "#{w["method"]} #{w["path"]}" : ""]
+        end
+        body = lines.join("\n") + "\n"
+        [200, {"Content-Type" => "text/plain", "Content-Length" => body.bytesize.to_s, "Cache-Control" => "no-cache"}, [body]]
+      end
+
+      # Prometheus text format. buckets are reported at each power of two
+      def _metrics_response
+        metrics = ::Rhebok.metrics
+        le = metrics["le"]
+        lines = []
+        lines << "# HELP rhebok_phase_seconds Time spent in each phase of request processing."
+        lines << "# TYPE rhebok_phase_seconds histogram"
+        %w(accept header body app write gc).each do |phase|
+          counts = metrics[phase]["counts"]
+          cumulative = 0
+          counts.each_with_index do |count, i|
+            cumulative += count
+            next if i != 0 && i != counts.size - 1 && i % 4 != 0
+            bound = i == counts.size - 1 ? "+Inf" : le[i].to_s
+            lines << "rhebok_phase_seconds_bucket{phase=\"#{phase}\",le=\"#{bound}\"} #{cumulative}"
           end
-          env = env_template.clone
-          connection, buf = ::Rhebok.accept_rack(fileno, @options[:Timeout], @_is_tcp, env)
-          if connection
+          lines << "rhebok_phase_seconds_sum{phase=\"#{phase}\"} #{metrics[phase]["sum"]}"
+          lines << "rhebok_phase_seconds_count{phase=\"#{phase}\"} #{metrics[phase]["count"]}"
+        end
+        lines << "# HELP rhebok_workers Number of workers in each state."
+        lines << "# TYPE rhebok_workers gauge"
+        workers = ::Rhebok.scoreboard
+        %w(idle reading app writing).each do |state|
+          lines << "rhebok_workers{state=\"#{state}\"} #{workers.count { |w| w["state"] == state }}"
+        end
+        body = lines.join("\n") + "\n"
+        [200, {"Content-Type" => "text/plain; version=0.0.4", "Content-Length" => body.bytesize.to_s, "Cache-Control" => "no-cache"}, [body]]
+      end
+
+      def _serve_connection(app, connection, buf, env, env_template)
+        keepalive_timeout = @options[:KeepAliveTimeout].to_f
+        max_reqs = @max_reqs
+        gc_reqs = @gc_reqs
+        gc_budget = @options[:OobGCBudget].to_f
+        memory_limit = @options[:MemoryLimit].to_i
+        memory_check_interval = @options[:MemoryCheckInterval].to_i
+        status_path = @options[:StatusPath]
+        metrics_path = @options[:MetricsPath]
+        stream_buffer_size = @options[:StreamBufferSize].to_i
+        streaming_input = @options[:StreamingInput]
+        memory_max = @options[:MaxMemoryBufferSize].to_i
+        lazy_env = @options[:LazyEnv]
+
+        remote_addr = env["REMOTE_ADDR"]
+        remote_port = env["REMOTE_PORT"]
+        keepalive_reqs = 0
+        begin
+          while true
             # for tempfile
             buffer = nil
+            input = nil
+            keepalive = false
             begin
-              proc_req_count += 1
+              @proc_req_count += 1
+              keepalive_reqs += 1
+              if @options[:KeepAlive] && keepalive_reqs < @options[:MaxKeepAliveRequests].to_i &&
+                 ( @options[:MaxRequestPerChild].to_i == 0 || @proc_req_count < max_reqs )
+                if env["SERVER_PROTOCOL"] == "HTTP/1.1"
+                  keepalive = env["HTTP_CONNECTION"] !~ /\bclose\b/i
+                else
+                  keepalive = env["HTTP_CONNECTION"] =~ /\bkeep-alive\b/i ? true : false
+                end
+              end
               # handle request
               if env.key?("CONTENT_LENGTH") && env["CONTENT_LENGTH"].to_i > 0
                 cl = env["CONTENT_LENGTH"].to_i
-                buffer = ::Rhebok::Buffered.new(cl,MAX_MEMORY_BUFFER_SIZE)
-                while cl > 0
-                  chunk = ""
-                  if buf.bytesize > 0
-                    chunk = buf
-                    buf = ""
-                  else
-                    readed = ::Rhebok.read_timeout(connection, chunk, cl, 0, @options[:Timeout])
-                    if readed == nil
-                      return
-                    end
+                if @options[:MaxRequestBodySize].to_i > 0 && cl > @options[:MaxRequestBodySize].to_i
+                  ::Rhebok.write_all(connection, ENTITY_TOO_LARGE, 0, @options[:Timeout])
+                  break
+                end
+                if streaming_input
+                  input = ::Rhebok::Input.new(connection, buf, cl, 0, @options[:Timeout], memory_max)
+                  env["rack.input"] = input
+                else
+                  buffer = ::Rhebok::Buffered.new(cl,memory_max)
+                  buf = buffer.read_from(connection, buf, cl, @options[:Timeout])
+                  if buf == nil
+                    break
                   end
-                  buffer.print(chunk)
-                  cl -= chunk.bytesize
+                  env["rack.input"] = buffer.rewind
                 end
-                env["rack.input"] = buffer.rewind
               elsif env.key?("HTTP_TRANSFER_ENCODING") && env.delete("HTTP_TRANSFER_ENCODING") == 'chunked'
-                buffer = ::Rhebok::Buffered.new(0,MAX_MEMORY_BUFFER_SIZE)
-                chunked_buffer = '';
-                complete = false
-                while !complete
-                  chunk = ""
-                  if buf.bytesize > 0
-                    chunk = buf
-                    buf = ""
-                  else
-                    readed = ::Rhebok.read_timeout(connection, chunk, 16384, 0, @options[:Timeout])
-                    if readed == nil
-                      return
-                    end
-                  end
-                  chunked_buffer << chunk
-                  while chunked_buffer.sub!(/^(([0-9a-fA-F]+).*\015\012)/,"") != nil
-                    trailer = $1
-                    chunked_len = $2.hex
-                    if chunked_len == 0
-                      complete = true
-                      break
-                    elsif chunked_buffer.bytesize < chunked_len + 2
-                      chunked_buffer = trailer + chunked_buffer
-                      break
-                    end
-                    buffer.print(chunked_buffer.byteslice(0,chunked_len))
-                    chunked_buffer = chunked_buffer.byteslice(chunked_len,chunked_buffer.bytesize-chunked_len)
-                    chunked_buffer.sub!(/^\015\012/,"")
+                if streaming_input
+                  # CONTENT_LENGTH is unknown until the app reads the whole body
+                  input = ::Rhebok::Input.new(connection, buf, -1, @options[:MaxRequestBodySize].to_i, @options[:Timeout], memory_max)
+                  env["rack.input"] = input
+                else
+                  buffer = ::Rhebok::Buffered.new(0,memory_max)
+                  buf = buffer.read_chunked_from(connection, buf, @options[:MaxRequestBodySize].to_i, @options[:Timeout])
+                  if buf == nil
+                    break
                   end
-                  break if complete
+                  env["CONTENT_LENGTH"] = buffer.size.to_s
+                  env["rack.input"] = buffer.rewind
                 end
-                env["CONTENT_LENGTH"] = buffer.size.to_s
-                env["rack.input"] = buffer.rewind
               end
 
-              status_code, headers, body = app.call(env)
+              if status_path && env["PATH_INFO"] == status_path
+                status_code, headers, body = self._status_response
+              elsif metrics_path && env["PATH_INFO"] == metrics_path
+                status_code, headers, body = self._metrics_response
+              else
+                env.default_proc = LAZY_HEADER if lazy_env
+                status_code, headers, body = app.call(env)
+              end
 
               use_chunked = 0
               if @options[:ChunkedTransfer]
@@ -304,43 +758,82 @@ module Rack
                                headers.key?("Content-Length") ? 0 : 1
               end
 
+              # the next request follows the body. the connection can not be
+              # reused when the app did not read the body to the end
+              if input != nil
+                rest = input.rest
+                if rest == nil
+                  keepalive = false
+                else
+                  buf = rest
+                end
+              end
+
+              if keepalive
+                keepalive = self._keepalive_response?(env, status_code.to_i, headers, body, use_chunked)
+              end
+
               if body.instance_of?(Array)
-                ::Rhebok.write_response(connection, @options[:Timeout], status_code.to_i, headers, body, use_chunked, 0)
-              else
-                ::Rhebok.write_response(connection, @options[:Timeout], status_code.to_i, headers, [], use_chunked, 1)
-                body.each do |part|
-                  ret = nil
-                  if use_chunked == 1
-                    ret = ::Rhebok.write_chunk(connection, part, 0, @options[:Timeout])
-                  else
-                    ret = ::Rhebok.write_all(connection, part, 0, @options[:Timeout])
-                  end
-                  if ret == nil
-                    break
+                ret = ::Rhebok.write_response(connection, @options[:Timeout], status_code.to_i, headers, body, use_chunked, 0, keepalive ? 1 : 0)
+                keepalive = false if ret == nil
+              elsif use_chunked == 0 && body.respond_to?(:to_path) && ::File.file?(body.to_path) &&
+                    (range = self._file_range(status_code.to_i, headers, ::File.size(body.to_path)))
+                ::File.open(body.to_path, 'rb') do |file|
+                  offset, length = range
+                  ret = ::Rhebok.write_response(connection, @options[:Timeout], status_code.to_i, headers, [], use_chunked, 2, keepalive ? 1 : 0)
+                  if ret != nil && length > 0
+                    ret = ::Rhebok.sendfile(connection, file.fileno, offset, length, @options[:Timeout])
                   end
-                end #body.each
-                ::Rhebok.write_all(connection, "0\015\012\015\012", 0, @options[:Timeout]) if use_chunked == 1
+                end
+                keepalive = false if ret == nil
+                body.respond_to?(:close) and body.close
+              else
+                ret = ::Rhebok.stream_response(connection, @options[:Timeout], status_code.to_i, headers, body, use_chunked, keepalive ? 1 : 0, stream_buffer_size)
+                keepalive = false if ret == nil
                 body.respond_to?(:close) and body.close
               end
+              # close with unread body resets the connection, and the client
+              # may lose the response. read the rest away first
+              if input != nil && !keepalive
+                input.drain(DRAIN_BODY_SIZE, DRAIN_BODY_TIMEOUT)
+              end
               #p [env,status_code,headers,body]
             ensure
               if buffer != nil
                 buffer.close
               end
-              ::Rhebok.close_rack(connection)
-              # out of band gc
-              if @options[:OobGC]
-                if $RACK_HANDLER_RHEBOK_GCTOOL
-                  GC::OOB.run
-                elsif proc_req_count % gc_reqs == 0
-                  disabled = GC.enable
-                  GC.start
-                  GC.disable if disabled
-                end
-              end
             end #begin
-          end # accept
-        end #while max_reqs
+
+            break if !keepalive || @term_received > 0
+            buf, env = ::Rhebok.read_rack(connection, buf, keepalive_timeout, @options[:Timeout], env_template, remote_addr, remote_port)
+            break if buf == nil
+          end # keepalive
+        ensure
+          ::Rhebok.close_rack(connection)
+          # out of band gc
+          if @options[:AdaptiveOobGC]
+            # only when the heap needs it and no connection is waiting
+            ::Rhebok.adaptive_oob_gc(@server.fileno, gc_budget)
+          elsif @options[:OobGC]
+            if $RACK_HANDLER_RHEBOK_GCTOOL
+              ::Rhebok.oob_gc { GC::OOB.run }
+            elsif @proc_req_count - @gc_req_count >= gc_reqs
+              @gc_req_count = @proc_req_count
+              ::Rhebok.oob_gc
+            end
+          end
+          # checked after GC. exit like TERM after requests in progress
+          if memory_limit > 0 && @proc_req_count - @memory_check_count >= memory_check_interval
+            @memory_check_count = @proc_req_count
+            memory = self._worker_memory($$)
+            if memory && memory > memory_limit && @term_received == 0
+              puts "worker #{$$} uses #{memory / 1024}KB over MemoryLimit. exiting"
+              # worker exits by exit!
+              $stdout.flush
+              @term_received += 1
+            end
+          end
+        end #begin
       end #def
 
     end
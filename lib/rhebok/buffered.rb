@@ -1,46 +1,35 @@
-require 'stringio'
-require 'tempfile'
-
 class Rhebok
+  # request body. bytes over memory_max are written to an anonymous file
+  # (O_TMPFILE) and read back from a read-only mapping of it
   class Buffered
     def initialize(length=0,memory_max=1048576)
-      @length = length
-      @memory_max = memory_max
-      @size = 0
-      if length > memory_max
-        @buffer = Tempfile.open('r')
-        @buffer.binmode
-        @buffer.set_encoding('BINARY')
-      else
-        @buffer = StringIO.new("").set_encoding('BINARY')
-      end
+      @buffer = ::Rhebok::SpillBuffer.new(length, memory_max)
     end
 
     def print(buf)
-      if @size + buf.bytesize > @memory_max && @buffer.instance_of?(StringIO)
-        new_buffer = Tempfile.open('r')
-        new_buffer.binmode
-        new_buffer.set_encoding('BINARY')
-        new_buffer << @buffer.string
-        @buffer = new_buffer
-      end
-      @buffer << buf
-      @size += buf.bytesize
+      @buffer.print(buf)
+    end
+
+    # read the whole body from the client socket. returns bytes after the body
+    def read_from(fileno, buf, length, timeout)
+      ::Rhebok.read_body(fileno, buf, length, @buffer, timeout)
+    end
+
+    # decode chunked body from the client socket. returns bytes after the body
+    def read_chunked_from(fileno, buf, max_size, timeout)
+      ::Rhebok.read_chunked(fileno, buf, @buffer, max_size, timeout)
     end
 
     def size
-      @size
+      @buffer.size
     end
 
     def rewind
       @buffer.rewind
-      @buffer
     end
 
     def close
-      if @buffer.instance_of?(Tempfile)
-        @buffer.close!
-      end
+      @buffer.close
     end
   end
 end
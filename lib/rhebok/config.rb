@@ -20,6 +20,22 @@ class Rhebok
       @config[:MaxWorkers] = val
     end
 
+    def min_workers(val)
+      @config[:MinWorkers] = val
+    end
+
+    def min_spare_workers(val)
+      @config[:MinSpareWorkers] = val
+    end
+
+    def max_spare_workers(val)
+      @config[:MaxSpareWorkers] = val
+    end
+
+    def scale_down_delay(val)
+      @config[:ScaleDownDelay] = val
+    end
+
     def timeout(val)
       @config[:Timeout] = val
     end
@@ -32,6 +48,26 @@ class Rhebok
       @config[:MinRequestPerChild] = val
     end
 
+    def memory_limit(val)
+      @config[:MemoryLimit] = val
+    end
+
+    def hard_memory_limit(val)
+      @config[:HardMemoryLimit] = val
+    end
+
+    def memory_limit_pss(val)
+      @config[:MemoryLimitPSS] = val
+    end
+
+    def memory_check_interval(val)
+      @config[:MemoryCheckInterval] = val
+    end
+
+    def preload(val)
+      @config[:Preload] = val
+    end
+
     def spawn_interval(val)
       @config[:SpawnInterval] = val
     end
@@ -52,6 +88,14 @@ class Rhebok
       @config[:MinGCPerRequest] = val
     end
 
+    def adaptive_oobgc(val)
+      @config[:AdaptiveOobGC] = val
+    end
+
+    def oobgc_budget(val)
+      @config[:OobGCBudget] = val
+    end
+
     def backlog(val)
       @config[:BackLog] = val
     end
@@ -64,6 +108,10 @@ class Rhebok
       @config[:AfterFork] = block
     end
 
+    def warmup(&block)
+      @config[:Warmup] = block
+    end
+
     def reuseport(&block)
       @config[:ReusePort] = block
     end
@@ -72,6 +120,78 @@ class Rhebok
       @config[:ChunkedTransfer] = block
     end
 
+    def keepalive(val)
+      @config[:KeepAlive] = val
+    end
+
+    def keepalive_timeout(val)
+      @config[:KeepAliveTimeout] = val
+    end
+
+    def max_keepalive_requests(val)
+      @config[:MaxKeepAliveRequests] = val
+    end
+
+    def max_request_body_size(val)
+      @config[:MaxRequestBodySize] = val
+    end
+
+    def max_header_size(val)
+      @config[:MaxHeaderSize] = val
+    end
+
+    def threads(val)
+      @config[:Threads] = val
+    end
+
+    def fiber_scheduler(val=nil, &block)
+      @config[:FiberScheduler] = block || val
+    end
+
+    def fibers(val)
+      @config[:Fibers] = val
+    end
+
+    def exclusive_accept(val)
+      @config[:ExclusiveAccept] = val
+    end
+
+    def reuseport_per_worker(val)
+      @config[:ReusePortPerWorker] = val
+    end
+
+    def io_uring(val)
+      @config[:IOUring] = val
+    end
+
+    def cpu_affinity(val)
+      @config[:CPUAffinity] = val
+    end
+
+    def status_path(val)
+      @config[:StatusPath] = val
+    end
+
+    def metrics_path(val)
+      @config[:MetricsPath] = val
+    end
+
+    def lazy_env(val)
+      @config[:LazyEnv] = val
+    end
+
+    def stream_buffer_size(val)
+      @config[:StreamBufferSize] = val
+    end
+
+    def max_memory_buffer_size(val)
+      @config[:MaxMemoryBufferSize] = val
+    end
+
+    def streaming_input(val)
+      @config[:StreamingInput] = val
+    end
+
     def retrieve
       @config
     end
@@ -0,0 +1,61 @@
+require 'prefork_engine'
+
+class Rhebok
+  # PreforkEngine keeping the number of workers between min_workers and
+  # max_workers, like spare servers of Apache prefork. workers are added while
+  # connections wait in the listen queue or idle workers are fewer than
+  # min_spare_workers, and retired one per second after idle workers stayed
+  # more than max_spare_workers for scale_down_delay seconds.
+  # idle workers are read from the scoreboard
+  class ScalingEngine < ::PreforkEngine
+    def initialize(options={}, scaling={})
+      super(options)
+      @max_workers = options["max_workers"].to_i
+      @min_workers = [scaling["min_workers"].to_i, @max_workers].min
+      @min_spare_workers = scaling["min_spare_workers"].to_i
+      @max_spare_workers = scaling["max_spare_workers"].to_i
+      @scale_down_delay = scaling["scale_down_delay"].to_f
+      @listen_fileno = scaling["listen_fileno"]
+      @_retiring = {}
+      @_surplus_since = nil
+    end
+
+    def _decide_action
+      @_retiring.delete_if { |pid, at| !(::Process.kill(0, pid) rescue false) }
+      workers = self.num_workers - @_retiring.size
+      return 1 if workers < @min_workers
+
+      board = ::Rhebok.scoreboard.select { |w|
+        !@_retiring.key?(w["pid"]) && (::Process.kill(0, w["pid"]) rescue false)
+      }
+      # workers not in the scoreboard yet are starting to accept
+      idle = board.count { |w| w["state"] == "idle" } + [workers - board.size, 0].max
+      queue = @listen_fileno && ::Rhebok.listen_queue(@listen_fileno)
+      queued = queue ? queue[0] : 0
+
+      if workers < @max_workers && (idle < @min_spare_workers || queued > idle)
+        @_surplus_since = nil
+        return 1
+      end
+      if workers > @min_workers && idle > @max_spare_workers && queued == 0
+        now = Time.now.to_f
+        @_surplus_since ||= now
+        retiree = board.find { |w| w["state"] == "idle" }
+        if retiree && now - @_surplus_since >= @scale_down_delay
+          ::Process.kill("TERM", retiree["pid"]) rescue nil
+          @_retiring[retiree["pid"]] = now
+          # next one after a second
+          @_surplus_since = now - @scale_down_delay + 1
+        end
+      else
+        @_surplus_since = nil
+      end
+      0
+    end
+
+    # wake up every second to watch the queue instead of waiting for a child
+    def _max_wait
+      1
+    end
+  end
+end
@@ -0,0 +1,74 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| [200, {"Content-Type"=>"text/plain"}, [env["PATH_INFO"], env["rack.input"].read]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :KeepAlive=>true)
+      exit!(true)
+    end
+    sleep 1
+
+    c = TCPSocket.open(@host, @port)
+    c.write("GET /foo HTTP/1.1\r\nHost: localhost\r\n\r\n" +
+            "POST /bar HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3\r\n\r\nabc" +
+            "GET /baz HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+    responses = outbuf.split(/(?=HTTP\/1\.1 200 OK\r\n)/)
+
+    should "pipelined requests" do
+      responses.size.should.equal 3
+      responses[0].should.match(/Connection: keep-alive\r\n/)
+      responses[0].should.match(/Content-Length: 4\r\n/)
+      responses[0].should.match(/\r\n\r\n\/foo\z/)
+      responses[1].should.match(/Connection: keep-alive\r\n/)
+      responses[1].should.match(/\r\n\r\n\/barabc\z/)
+      responses[2].should.match(/Connection: close\r\n/)
+      responses[2].should.match(/\r\n\r\n\/baz\z/)
+    end
+
+    c = TCPSocket.open(@host, @port)
+    c.write("POST /foo HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n" +
+            "3;ext=1\r\nabc\r\n1\r\nd\r\n0\r\nX-Trailer: 1\r\n\r\n" +
+            "GET /bar HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+    responses = outbuf.split(/(?=HTTP\/1\.1 200 OK\r\n)/)
+
+    should "pipelined request after chunked body" do
+      responses.size.should.equal 2
+      responses[0].should.match(/Connection: keep-alive\r\n/)
+      responses[0].should.match(/\r\n\r\n\/fooabcd\z/)
+      responses[1].should.match(/\r\n\r\n\/bar\z/)
+    end
+
+    c = TCPSocket.open(@host, @port)
+    c.write("GET /foo HTTP/1.0\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+
+    should "close HTTP/1.0 without keep-alive" do
+      outbuf.should.match(/Connection: close\r\n/)
+      outbuf.should.not.match(/Content-Length/)
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
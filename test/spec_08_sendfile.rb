@@ -0,0 +1,71 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+class PathBody
+  def initialize(path, content = nil)
+    @path = path
+    @content = content
+  end
+
+  def to_path
+    @path
+  end
+
+  def each
+    yield @content || ::File.binread(@path)
+  end
+end
+
+describe Rhebok do
+  extend TestRequest::Helpers
+
+  @host = '127.0.0.1'
+  @port = 9202
+  @path = File.expand_path('../testrequest.rb', __FILE__)
+
+  test_rhebok( proc { |env|
+    if env["PATH_INFO"] == "/range"
+      [206, {"Content-Type"=>"text/plain", "Content-Range"=>"bytes 6-9/#{File.size(@path)}", "Content-Length"=>"4"}, PathBody.new(@path)]
+    elsif env["PATH_INFO"] == "/multirange"
+      size = File.size(@path)
+      content = File.read(@path)
+      parts = "--B\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-1/#{size}\r\n\r\n#{content[0,2]}\r\n" +
+        "--B\r\nContent-Type: text/plain\r\nContent-Range: bytes 6-9/#{size}\r\n\r\n#{content[6,4]}\r\n--B--\r\n"
+      [206, {"Content-Type"=>"multipart/byteranges; boundary=B", "Content-Length"=>parts.bytesize.to_s}, PathBody.new(@path, parts)]
+    elsif env["PATH_INFO"] == "/badrange"
+      [206, {"Content-Type"=>"text/plain", "Content-Range"=>"bytes 6-999999/*", "Content-Length"=>"5"}, PathBody.new(@path, "short")]
+    else
+      [200, {"Content-Type"=>"text/plain", "Content-Length"=>File.size(@path).to_s}, PathBody.new(@path)]
+    end
+  }, proc {
+    command = 'curl  --stderr - -sv http://127.0.0.1:9202/'
+    curl_request(command)
+    should "to_path body with curl" do
+      @header["Content-Length"].should.equal File.size(@path).to_s
+      @body.should.equal File.read(@path)
+    end
+    command = 'curl  --stderr - -sv http://127.0.0.1:9202/range'
+    curl_request(command)
+    should "to_path body with range" do
+      @header["Content-Range"].should.match(/^bytes 6-9\//)
+      @body.should.equal File.read(@path)[6,4]
+    end
+    command = 'curl  --stderr - -sv http://127.0.0.1:9202/multirange'
+    curl_request(command)
+    should "stream multipart/byteranges instead of sendfile" do
+      @header["Content-Type"].should.equal "multipart/byteranges; boundary=B"
+      @body.should.match(/\A--B\r\n/)
+      @body.should.include File.read(@path)[6,4]
+      @body.bytesize.should.equal @header["Content-Length"].to_i
+    end
+    command = 'curl  --stderr - -sv http://127.0.0.1:9202/badrange'
+    curl_request(command)
+    should "stream a range outside the file instead of sendfile" do
+      @body.should.equal "short"
+    end
+  })
+
+end
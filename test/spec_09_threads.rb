@@ -0,0 +1,52 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      sleep 1 if env["PATH_INFO"] == "/sleep"
+      [200, {"Content-Type"=>"text/plain"}, [env["rack.multithread"].to_s]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :Threads=>4)
+      exit!(true)
+    end
+    sleep 1
+
+    started = Time.now
+    clients = (1..4).map {
+      c = TCPSocket.open(@host, @port)
+      c.write("GET /sleep HTTP/1.0\r\n\r\n")
+      c
+    }
+    bodies = clients.map { |c|
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.split("\r\n\r\n",2)[1]
+    }
+    elapsed = Time.now - started
+
+    should "serve requests concurrently in threads" do
+      bodies.should.equal ["true","true","true","true"]
+      elapsed.should.be < 3
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
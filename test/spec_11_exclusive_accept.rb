@@ -0,0 +1,56 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| [200, {"Content-Type"=>"text/plain"}, [$$.to_s]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>4, :ExclusiveAccept=>true)
+      exit!(true)
+    end
+    sleep 1
+
+    bodies = (1..20).map {
+      c = TCPSocket.open(@host, @port)
+      c.write("GET / HTTP/1.0\r\n\r\n")
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.split("\r\n\r\n",2)[1]
+    }
+
+    # EPOLLEXCLUSIVE of the events mask in fdinfo of each epoll instance
+    exclusive = worker_pids(@pid).map { |pid|
+      Dir.glob("/proc/#{pid}/fd/*").any? { |fd|
+        (File.readlink(fd) rescue nil) == "anon_inode:[eventpoll]" &&
+          File.read(fd.sub("/fd/", "/fdinfo/")).scan(/^tfd:.*events:\s*([0-9a-f]+)/).any? { |events| events[0].hex & 0x10000000 != 0 }
+      }
+    }
+
+    should "serve requests with exclusive accept" do
+      bodies.size.should.equal 20
+      bodies.each { |body| body.should.match(/\A\d+\z/) }
+    end
+
+    should "wait for connections in epoll with EPOLLEXCLUSIVE in every worker" do
+      exclusive.should.equal [true] * 4
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
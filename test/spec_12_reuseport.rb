@@ -0,0 +1,82 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      sleep 0.002 if env["PATH_INFO"] == "/slow"
+      [200, {"Content-Type"=>"text/plain"}, [$$.to_s]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>2, :ReusePortPerWorker=>true, :BackLog=>512)
+      exit!(true)
+    end
+    sleep 1
+
+    bodies = (1..20).map {
+      c = TCPSocket.open(@host, @port)
+      c.write("GET / HTTP/1.0\r\n\r\n")
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.split("\r\n\r\n",2)[1]
+    }
+
+    # listening sockets on the port and the ones each worker holds
+    listening = File.readlines("/proc/net/tcp").drop(1).map(&:split).select { |f|
+      f[1].end_with?(":%04X" % @port) && f[3] == "0A"
+    }.map { |f| f[9] }
+    listeners = worker_pids(@pid).map { |pid|
+      Dir.glob("/proc/#{pid}/fd/*").map { |fd| (File.readlink(fd) rescue "")[/\Asocket:\[(\d+)\]\z/, 1] }.compact & listening
+    }
+
+    should "serve requests with listener per worker" do
+      bodies.size.should.equal 20
+      bodies.each { |body| body.should.match(/\A\d+\z/) }
+    end
+
+    should "give each worker its own listening socket" do
+      listeners.map(&:size).should.equal [1, 1]
+      listeners.flatten.uniq.size.should.equal 2
+      listening.size.should.equal 2
+    end
+
+    should "stop under steady load" do
+      loaders = (1..2).map {
+        fork {
+          while true
+            begin
+              c = TCPSocket.open(@host, @port)
+              c.write("GET /slow HTTP/1.0\r\n\r\n")
+              c.close
+            rescue SystemCallError, IOError
+            end
+          end
+        }
+      }
+      sleep 1
+      Process.kill(:TERM, @pid)
+      stopped = Timeout.timeout(10) { Process.wait(@pid) } rescue nil
+      loaders.each { |pid| Process.kill(:KILL, pid); Process.wait(pid) }
+      stopped.should.equal @pid
+      @pid = nil if stopped
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,43 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| [200, {"Content-Type"=>"text/plain"}, [env["rack.input"].read.bytesize.to_s]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :IOUring=>true, :ReusePortPerWorker=>true)
+      exit!(true)
+    end
+    sleep 1
+
+    bodies = (1..20).map { |i|
+      c = TCPSocket.open(@host, @port)
+      c.write("POST / HTTP/1.0\r\nContent-Length: #{i * 1000}\r\n\r\n" + "x" * (i * 1000))
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.split("\r\n\r\n",2)[1]
+    }
+
+    should "serve requests with io_uring" do
+      bodies.should.equal (1..20).map { |i| (i * 1000).to_s }
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,58 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| [200, {"Content-Type"=>"text/plain"}, [::Rhebok.cpu_affinity.join(",")]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>2, :CPUAffinity=>"cpu")
+      exit!(true)
+    end
+    sleep 1
+
+    bodies = (1..10).map {
+      c = TCPSocket.open(@host, @port)
+      c.write("GET / HTTP/1.0\r\n\r\n")
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.split("\r\n\r\n",2)[1]
+    }
+
+    # affinity the kernel reports for each worker, and what the handler plans
+    handler = Rack::Handler::Rhebok.new({})
+    sets = handler._cpu_sets("cpu").map { |cpus, node| cpus }
+    expected = (0...2).map { |i| sets[i % sets.size] }.sort
+    affinities = worker_pids(@pid).map { |pid|
+      handler._parse_cpu_list(File.read("/proc/#{pid}/status")[/^Cpus_allowed_list:\s*(.*)$/, 1])
+    }.sort
+
+    should "pin each worker to a cpu" do
+      bodies.size.should.equal 10
+      bodies.each { |body| body.should.match(/\A\d+\z/) }
+    end
+
+    should "set the affinity of each worker process" do
+      affinities.size.should.equal 2
+      affinities.should.equal expected
+      affinities.each { |cpus| cpus.size.should.equal 1 }
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,47 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| sleep 2 if env["PATH_INFO"] == "/slow"; [200, {"Content-Type"=>"text/plain"}, ["app"]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>2, :StatusPath=>"/rhebok-status")
+      exit!(true)
+    end
+    sleep 1
+
+    slow = TCPSocket.open(@host, @port)
+    slow.write("GET /slow HTTP/1.0\r\n\r\n")
+    sleep 0.5
+    c = TCPSocket.open(@host, @port)
+    c.write("GET /rhebok-status HTTP/1.0\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+    c.close
+    status = outbuf.split("\r\n\r\n",2)[1]
+    slow.read
+    slow.close
+
+    should "show workers and their requests" do
+      status.should.match(/^Workers: 2 Busy: 2 Idle: 0$/)
+      status.should.match(/ app .* GET \/slow$/)
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
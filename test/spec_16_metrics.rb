@@ -0,0 +1,52 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| env["rack.input"].read; [200, {"Content-Type"=>"text/plain"}, ["app"]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :MetricsPath=>"/metrics")
+      exit!(true)
+    end
+    sleep 1
+
+    5.times {
+      c = TCPSocket.open(@host, @port)
+      c.write("POST / HTTP/1.0\r\nContent-Length: 5\r\n\r\nhello")
+      c.read
+      c.close
+    }
+    c = TCPSocket.open(@host, @port)
+    c.write("GET /metrics HTTP/1.0\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+    c.close
+    metrics = outbuf.split("\r\n\r\n",2)[1]
+
+    should "count each phase of requests" do
+      metrics.should.match(/^# TYPE rhebok_phase_seconds histogram$/)
+      metrics.should.match(/^rhebok_phase_seconds_count\{phase="accept"\} 6$/)
+      metrics.should.match(/^rhebok_phase_seconds_count\{phase="header"\} 6$/)
+      metrics.should.match(/^rhebok_phase_seconds_count\{phase="body"\} 5$/)
+      metrics.should.match(/^rhebok_phase_seconds_count\{phase="app"\} 5$/)
+      metrics.should.match(/^rhebok_phase_seconds_bucket\{phase="app",le="\+Inf"\} 5$/)
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
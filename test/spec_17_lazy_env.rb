@@ -0,0 +1,75 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      body = [
+        env.class.to_s,
+        env.keys.grep(/^HTTP_/).sort.join(","),
+        env.key?("HTTP_X_TRACE").to_s,
+        env["HTTP_X_TRACE"],
+        env.key?("HTTP_X_TRACE").to_s,
+        env["HTTP_X_MISSING"].inspect,
+        env.key?("HTTP_X_MISSING").to_s,
+        env.delete("HTTP_X_TRACE").to_s,
+        env["HTTP_X_TRACE"].inspect,
+        {}.merge(::Rhebok.materialize_env(env)).keys.grep(/^HTTP_/).sort.join(","),
+        env["HTTP_USER_AGENT"],
+      ].join("\n")
+      [200, {"Content-Type"=>"text/plain"}, [body]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :LazyEnv=>"true")
+      exit!(true)
+    end
+    sleep 1
+
+    c = TCPSocket.open(@host, @port)
+    c.write("GET / HTTP/1.0\r\nHost: localhost\r\nUser-Agent: u\r\nX-Trace: a\r\nX-Cdn: b\r\nx-trace: c\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+    c.close
+    lines = outbuf.split("\r\n\r\n",2)[1].split("\n")
+
+    should "build a deferred header when the app reads it" do
+      lines[0].should.equal "Hash"
+      lines[1].should.equal "HTTP_HOST"
+      lines[2].should.equal "false"
+      lines[3].should.equal "a, c"
+      lines[4].should.equal "true"
+    end
+
+    should "not store headers the request does not have" do
+      lines[5].should.equal "nil"
+      lines[6].should.equal "false"
+    end
+
+    should "build a header only once" do
+      lines[7].should.equal "a, c"
+      lines[8].should.equal "nil"
+    end
+
+    should "build headers left by materialize_env" do
+      lines[9].should.equal "HTTP_HOST,HTTP_USER_AGENT,HTTP_X_CDN"
+      lines[10].should.equal "u"
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,72 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+class ManyPartsBody
+  def each
+    100.times { |i| yield "part#{i}\n" }
+    yield "x" * 5000
+    yield "end\n"
+  end
+end
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| [200, {"Content-Type"=>"text/plain"}, ManyPartsBody.new] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :ChunkedTransfer=>1, :StreamBufferSize=>"512")
+      exit!(true)
+    end
+    sleep 1
+
+    expected = ""
+    ManyPartsBody.new.each { |part| expected << part }
+
+    c = TCPSocket.open(@host, @port)
+    c.write("GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+    outbuf = ""
+    c.read(nil,outbuf)
+    c.close
+    header, chunked = outbuf.split("\r\n\r\n",2)
+    chunks = []
+    while chunked =~ /\A([0-9a-f]+)\r\n/
+      len = $1.hex
+      chunked = $'
+      chunks << chunked[0, len]
+      chunked = chunked[len + 2 .. -1]
+    end
+
+    c = TCPSocket.open(@host, @port)
+    c.write("GET / HTTP/1.0\r\n\r\n")
+    plain = ""
+    c.read(nil,plain)
+    c.close
+
+    should "coalesce parts into chunks" do
+      header.should.match(/^Transfer-Encoding: chunked\r$/)
+      chunks.last.should.equal ""
+      chunks.join.should.equal expected
+      (chunks.size < 20).should.equal true
+    end
+
+    should "write the same body without chunked" do
+      plain.split("\r\n\r\n",2)[1].should.equal expected
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
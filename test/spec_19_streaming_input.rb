@@ -0,0 +1,79 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      input = env["rack.input"]
+      if env["PATH_INFO"] == "/skip"
+        body = input.read(5)
+      else
+        line = input.gets
+        body = input.read
+        input.rewind
+        body = [input.class.to_s, line, body, input.read.bytesize, env["CONTENT_LENGTH"].to_s].join(",")
+      end
+      [200, {"Content-Type"=>"text/plain", "Content-Length"=>body.bytesize.to_s}, [body]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :KeepAlive=>true, :StreamingInput=>"true")
+      exit!(true)
+    end
+    sleep 1
+
+    c = TCPSocket.open(@host, @port)
+    c.write("POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: 10\r\n\r\nfoo\nbar")
+    sleep 0.2
+    c.write("baz")
+    c.write("POST / HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n")
+    c.write("4\r\nfoo\n\r\n5\r\nbarba\r\n1\r\nz\r\n0\r\n\r\n")
+    keepalive = ""
+    c.read(nil,keepalive)
+    c.close
+
+    # the app reads 5 bytes and leaves the rest in the socket
+    skipped_body = "0123456789" * 100000
+    c = TCPSocket.open(@host, @port)
+    c.write("POST /skip HTTP/1.1\r\nHost: localhost\r\nContent-Length: #{skipped_body.bytesize}\r\n\r\n")
+    writer = Thread.new { c.write(skipped_body) rescue nil }
+    skipped = ""
+    begin
+      c.read(nil,skipped)
+    rescue Errno::ECONNRESET
+    end
+    writer.join
+    c.close
+
+    should "read body with Content-Length from the socket" do
+      keepalive.should.match(/^Connection: keep-alive\r$/)
+      keepalive.should.match(/\A[^\r]+\r\n(?:.+\r\n)*?Content-Length: 31\r\n.*?\r\n\r\nRhebok::Input,foo\n,barbaz,10,10HTTP/m)
+    end
+
+    should "read chunked body in the same connection" do
+      keepalive.should.match(/\r\n\r\nRhebok::Input,foo\n,barbaz,10,\z/)
+    end
+
+    should "close connection when body is not read to the end" do
+      skipped.should.match(/^Connection: close\r$/)
+      skipped.should.match(/\r\n\r\n01234\z/)
+      writer.value.should.equal skipped_body.bytesize
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
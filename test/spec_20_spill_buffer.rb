@@ -0,0 +1,90 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      input = env["rack.input"]
+      lines = 0
+      input.each { |line| lines += 1 }
+      input.rewind
+      body = [input.class.to_s, input.spilled?, lines, input.read].join(",")
+      [200, {"Content-Type"=>"text/plain", "Content-Length"=>body.bytesize.to_s}, [body]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :MaxMemoryBufferSize=>1024)
+      exit!(true)
+    end
+    sleep 1
+
+    data = (0...1000).map { |i| "line#{i}\n" }.join
+
+    c = TCPSocket.open(@host, @port)
+    c.write("POST / HTTP/1.0\r\nContent-Length: #{data.bytesize}\r\n\r\n#{data}")
+    spilled = ""
+    c.read(nil,spilled)
+    c.close
+
+    c = TCPSocket.open(@host, @port)
+    c.write("POST / HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n")
+    data.scan(/.{1,700}/m).each { |part| c.write(part.bytesize.to_s(16) + "\r\n" + part + "\r\n") }
+    c.write("0\r\n\r\n")
+    chunked = ""
+    c.read(nil,chunked)
+    c.close
+
+    c = TCPSocket.open(@host, @port)
+    c.write("POST / HTTP/1.0\r\nContent-Length: 10\r\n\r\nfoo\nbarbaz")
+    memory = ""
+    c.read(nil,memory)
+    c.close
+
+    shmem = proc { File.read("/proc/meminfo")[/^Shmem:\s+(\d+)/, 1].to_i * 1024 }
+    shmem_before = shmem.call
+    c = TCPSocket.open(@host, @port)
+    c.write("POST / HTTP/1.0\r\nContent-Length: 536870912\r\n\r\nfoo")
+    sleep 1
+    shmem_grown = shmem.call - shmem_before
+    c.close
+
+    c = TCPSocket.open(@host, @port)
+    c.write("POST / HTTP/1.0\r\nContent-Length: 10\r\n\r\nfoo\nbarbaz")
+    after_huge = ""
+    c.read(nil,after_huge)
+    c.close
+
+    should "spill body with Content-Length over MaxMemoryBufferSize" do
+      spilled.split("\r\n\r\n",2)[1].should.equal "Rhebok::SpillBuffer,true,1000,#{data}"
+    end
+
+    should "spill chunked body growing over MaxMemoryBufferSize" do
+      chunked.split("\r\n\r\n",2)[1].should.equal "Rhebok::SpillBuffer,true,1000,#{data}"
+    end
+
+    should "keep small body in memory" do
+      memory.split("\r\n\r\n",2)[1].should.equal "Rhebok::SpillBuffer,false,2,foo\nbarbaz"
+    end
+
+    should "not reserve memory for a claimed Content-Length without body" do
+      (shmem_grown < 64 * 1024 * 1024).should.equal true
+      after_huge.split("\r\n\r\n",2)[1].should.equal "Rhebok::SpillBuffer,false,2,foo\nbarbaz"
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
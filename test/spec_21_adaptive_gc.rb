@@ -0,0 +1,80 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    server = TCPServer.new('127.0.0.1', 0)
+    # settle the heap
+    GC.start
+    ::Rhebok.adaptive_oob_gc(server.fileno, 0)
+    idle = ::Rhebok.adaptive_oob_gc(server.fileno, 0)
+
+    GC.disable
+    200.times { "x" * 1024 * 1024 }
+    client = TCPSocket.new('127.0.0.1', server.addr[1])
+    sleep 0.1
+    count = GC.count
+    waiting = ::Rhebok.adaptive_oob_gc(server.fileno, 0)
+    waiting_count = GC.count
+    server.accept.close
+    client.close
+    collected = ::Rhebok.adaptive_oob_gc(server.fileno, 0)
+    collected_count = GC.count
+    GC.enable
+
+    should "not collect without heap growth" do
+      idle.should.equal nil
+    end
+
+    should "not collect while connection is waiting" do
+      waiting.should.equal nil
+      waiting_count.should.equal count
+    end
+
+    should "collect when the heap needs" do
+      [:minor, :major].should.include collected
+      collected_count.should.equal count + 1
+    end
+
+  ensure
+    server.close if server
+  end
+
+  begin
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env| 1000.times { "x" * 10000 }; [200, {"Content-Type"=>"text/plain"}, ["ok"]] }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :AdaptiveOobGC=>"yes", :OobGCBudget=>"0.5")
+      exit!(true)
+    end
+    sleep 1
+
+    bodies = Array.new(20) {
+      c = TCPSocket.open(@host, @port)
+      c.write("GET / HTTP/1.0\r\n\r\n")
+      body = c.read
+      c.close
+      body
+    }
+
+    should "serve with AdaptiveOobGC" do
+      bodies.all? { |b| b.end_with?("\r\n\r\nok") }.should.equal true
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
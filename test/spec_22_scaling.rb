@@ -0,0 +1,62 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      sleep 1.5 if env["PATH_INFO"] == "/sleep"
+      [200, {"Content-Type"=>"text/plain"}, [$$.to_s]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>3, :MinWorkers=>1,
+                                :MinSpareWorkers=>0, :MaxSpareWorkers=>0, :ScaleDownDelay=>1, :StatusPath=>"/status")
+      exit!(true)
+    end
+    sleep 1
+
+    request = proc { |path|
+      c = TCPSocket.open(@host, @port)
+      c.write("GET #{path} HTTP/1.0\r\n\r\n")
+      body = c.read.split("\r\n\r\n", 2)[1]
+      c.close
+      body
+    }
+
+    before = request.call("/status")
+    started = Time.now
+    pids = Array.new(3) { Thread.new { request.call("/sleep") } }.map(&:value)
+    elapsed = Time.now - started
+    sleep 5
+    after = request.call("/status")
+
+    should "start with MinWorkers" do
+      before.should.match(/^Workers: 1 /)
+    end
+
+    should "add workers for queued connections" do
+      (pids.uniq.size > 1).should.equal true
+      (elapsed < 4).should.equal true
+    end
+
+    should "retire idle workers" do
+      after.should.match(/^Workers: 1 /)
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,58 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      body = [$warmed.to_s, ENV["TEST_BEFORE_FORK"].to_s, Process.ppid.to_s].join(",")
+      [200, {"Content-Type"=>"text/plain"}, [body]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>2, :Preload=>"yes", :StatusPath=>"/status",
+                                :Warmup=>proc { |app| app.call({}); $warmed = $$ },
+                                :BeforeFork=>proc { ENV["TEST_BEFORE_FORK"] = (ENV["TEST_BEFORE_FORK"].to_i + 1).to_s })
+      exit!(true)
+    end
+    sleep 1
+
+    request = proc { |path|
+      c = TCPSocket.open(@host, @port)
+      c.write("GET #{path} HTTP/1.0\r\n\r\n")
+      body = c.read.split("\r\n\r\n", 2)[1]
+      c.close
+      body
+    }
+    warmed, before_fork, master = request.call("/").split(",")
+    status = request.call("/status")
+
+    should "warm the app in the master" do
+      warmed.should.equal master
+    end
+
+    should "call BeforeFork once" do
+      before_fork.should.equal "1"
+    end
+
+    should "show PSS of workers" do
+      status.should.match(/ PSS\(KB\) /)
+      status.should.match(/^\d+\s+\d+\s+\w+\s+\d+\s+\d+\s+\d+\s/)
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,64 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      case env["PATH_INFO"]
+      when "/grow"
+        $keep = "x" * (160 * 1024 * 1024)
+      when "/bloat"
+        $keep = "x" * (320 * 1024 * 1024)
+        sleep 3
+      end
+      [200, {"Content-Type"=>"text/plain"}, [$$.to_s]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :MemoryCheckInterval=>1,
+                                :MemoryLimit=>(128 * 1024 * 1024), :HardMemoryLimit=>(256 * 1024 * 1024))
+      exit!(true)
+    end
+    sleep 1
+
+    request = proc { |path|
+      c = TCPSocket.open(@host, @port)
+      c.write("GET #{path} HTTP/1.0\r\n\r\n")
+      body = c.read.split("\r\n\r\n", 2)[1]
+      c.close
+      body
+    }
+
+    first = request.call("/")
+    grown = request.call("/grow")
+    recycled = request.call("/")
+    bloated = request.call("/bloat")
+    killed = request.call("/")
+
+    should "exit after the request over MemoryLimit" do
+      grown.should.equal first
+      recycled.should.not.equal first
+    end
+
+    should "kill worker over HardMemoryLimit" do
+      bloated.should.equal nil
+      killed.should.not.equal recycled
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -0,0 +1,78 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      body = [
+        env["PATH_INFO"],
+        env["QUERY_STRING"],
+        env.keys.grep(/^HTTP_X_/).sort.join(","),
+      ].join("\n")
+      [200, {"Content-Type"=>"text/plain"}, [body]]
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1)
+      exit!(true)
+    end
+    sleep 1
+
+    request = proc { |path, headers|
+      c = TCPSocket.open(@host, @port)
+      c.write("GET #{path} HTTP/1.0\r\nHost: localhost\r\n#{headers}\r\n")
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.force_encoding("BINARY")
+    }
+    lines = proc { |outbuf| outbuf.split("\r\n\r\n",2)[1].split("\n",-1) }
+
+    escaped = "/" + "a" * 40 + "/" + "%E3%81%82" * 7 + "/b"
+    long_escaped = request.call(escaped, "")
+    mixed_escaped = request.call("/" + "%e3%81%82%20" * 6, "")
+    invalid_escaped = request.call("/" + "a" * 20 + "%E3%81%82%E3%8Z%82%E3%81%82/b", "")
+    long_query = request.call("/" + "q" * 40 + "?x=%41&y=" + "z" * 40, "")
+    long_fragment = request.call("/" + "f" * 40 + "#frag?x=1", "")
+    long_header = request.call("/", "x-" + "long-header-name-" * 3 + "end: 1\r\nX-" + "Abc" * 12 + ": 2\r\n")
+
+    should "decode runs of escapes in a long path" do
+      lines.call(long_escaped)[0].should.equal "/" + "a" * 40 + "/" + "\xE3\x81\x82".b * 7 + "/b"
+      lines.call(mixed_escaped)[0].should.equal "/" + "\xE3\x81\x82 ".b * 6
+    end
+
+    should "drop a request with an invalid escape inside a block" do
+      invalid_escaped.should.equal ""
+    end
+
+    should "split query string after the first block" do
+      lines.call(long_query)[0].should.equal "/" + "q" * 40
+      lines.call(long_query)[1].should.equal "x=%41&y=" + "z" * 40
+    end
+
+    should "cut fragment after the first block" do
+      lines.call(long_fragment)[0].should.equal "/" + "f" * 40
+      lines.call(long_fragment)[1].should.equal ""
+    end
+
+    should "normalize long header names" do
+      lines.call(long_header)[2].should.equal "HTTP_X_" + "ABC" * 12 + ",HTTP_X_" + "LONG_HEADER_NAME_" * 3 + "END"
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
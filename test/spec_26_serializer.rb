@@ -0,0 +1,105 @@
+require 'rack'
+require File.expand_path('../testrequest', __FILE__)
+require 'timeout'
+require 'socket'
+require 'rack/handler/rhebok'
+
+FROZEN_HEADERS = {"Content-Type"=>"text/plain", "X-Cached"=>"yes", "Server"=>"Frozen"}.freeze
+COUNTER = "0"
+MUTABLE_HEADERS = {"Content-Type"=>"text/plain", "X-Count"=>COUNTER}.freeze
+
+describe Rhebok do
+  extend TestRequest::Helpers
+  begin
+
+    @host = '127.0.0.1'
+    @port = 9202
+    @app = proc { |env|
+      case env["PATH_INFO"]
+      when "/many"
+        [200, {"Content-Type"=>"text/plain"}, (0...3000).map { |i| "p#{i}\n" }]
+      when "/frozen"
+        [200, FROZEN_HEADERS, ["frozen"]]
+      when "/mutable"
+        COUNTER.succ!
+        [200, MUTABLE_HEADERS, ["mutable"]]
+      when "/multiline"
+        [200, {"Content-Type"=>"text/plain", "X-Multi"=>"a\nb\nc\n"}, ["multi"]]
+      else
+        [200, {"Content-Type"=>"text/plain", "Server"=>"s" * 300, "Date"=>"d" * 300}, ["long"]]
+      end
+    }
+    @pid = fork
+    if @pid == nil
+      #child
+      Rack::Handler::Rhebok.run(@app, :Host=>@host, :Port=>@port, :MaxWorkers=>1, :ChunkedTransfer=>1)
+      exit!(true)
+    end
+    sleep 1
+
+    request = proc { |path, protocol|
+      c = TCPSocket.open(@host, @port)
+      c.write("GET #{path} #{protocol}\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+      outbuf = ""
+      c.read(nil,outbuf)
+      c.close
+      outbuf.split("\r\n\r\n",2)
+    }
+
+    expected = (0...3000).map { |i| "p#{i}\n" }.join
+    many_plain = request.call("/many", "HTTP/1.0")
+    many_chunked = request.call("/many", "HTTP/1.1")
+    chunks = []
+    chunked = many_chunked[1]
+    while chunked =~ /\A([0-9a-f]+)\r\n/
+      len = $1.hex
+      chunked = $'
+      chunks << chunked[0, len]
+      chunked = chunked[len + 2 .. -1]
+    end
+    frozen = (0...3).map { request.call("/frozen", "HTTP/1.0")[0] }
+    mutable = (0...3).map { request.call("/mutable", "HTTP/1.0")[0][/^X-Count: .*$/] }
+    multiline = request.call("/multiline", "HTTP/1.0")
+    long_prefix = request.call("/long", "HTTP/1.0")
+
+    should "write more parts than IOV_MAX" do
+      many_plain[1].should.equal expected
+      many_chunked[0].should.match(/^Transfer-Encoding: chunked\r$/)
+      chunks.last.should.equal ""
+      chunks.join.should.equal expected
+    end
+
+    should "reuse serialized frozen headers" do
+      frozen.each { |header|
+        header.scan(/^X-Cached: yes\r$/).size.should.equal 1
+        header.scan(/^Server: Frozen\r$/).size.should.equal 1
+        header.should.match(/^Content-Type: text\/plain\r$/)
+      }
+    end
+
+    should "not cache headers with mutable values" do
+      mutable.should.equal ["X-Count: 1\r", "X-Count: 2\r", "X-Count: 3\r"]
+    end
+
+    should "write one line per value line" do
+      multiline[0].scan(/^X-Multi: .*\r$/).should.equal ["X-Multi: a\r", "X-Multi: b\r", "X-Multi: c\r"]
+      multiline[1].should.equal "multi"
+    end
+
+    should "write Server and Date longer than the prefix room" do
+      long_prefix[0].should.match(/\AHTTP\/1\.1 200 OK\r\n/)
+      long_prefix[0].should.match(/^Server: #{"s" * 300}\r$/)
+      long_prefix[0].should.match(/^Date: #{"d" * 300}\r$/)
+      long_prefix[0].should.match(/^Content-Type: text\/plain\r$/)
+      long_prefix[1].should.equal "long"
+    end
+
+  ensure
+    sleep 1
+    if @pid != nil
+      Process.kill(:TERM, @pid)
+      Process.wait()
+    end
+  end
+
+end
@@ -78,6 +78,14 @@ class TestRequest
       }
     end
 
+    # pids of the worker processes forked by master
+    def worker_pids(master)
+      Dir.glob("/proc/[0-9]*/stat").map { |stat|
+        fields = (File.read(stat) rescue "").sub(/\A\d+ \(.*\) /m, "").split(" ")
+        stat[/\d+/].to_i if fields[1].to_i == master
+      }.compact.sort
+    end
+
     def test_rhebok(app,cb,chunked=0)
       begin
         @pid = fork
@@ -0,0 +1,118 @@
+require 'io/nonblock'
+
+# minimal Fiber.scheduler using IO.select for tests
+class TestScheduler
+  def initialize
+    @readable = {}
+    @writable = {}
+    @waiting = {}
+    @blocking = {}
+    @ready = []
+    @lock = Thread::Mutex.new
+    @urgent = IO.pipe
+  end
+
+  def current_time
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def next_timeout
+    _fiber, timeout = @waiting.min_by { |_k, v| v }
+    if timeout
+      offset = timeout - current_time
+      offset < 0 ? 0 : offset
+    end
+  end
+
+  def run
+    while @readable.any? || @writable.any? || @waiting.any? || @blocking.any? || @ready.any?
+      readable, writable = IO.select(@readable.keys + [@urgent.first], @writable.keys, [], next_timeout)
+      selected = {}
+      readable && readable.each do |io|
+        if fiber = @readable.delete(io)
+          selected[fiber] = IO::READABLE
+        elsif io == @urgent.first
+          @urgent.first.read_nonblock(1024, exception: false)
+        end
+      end
+      writable && writable.each do |io|
+        if fiber = @writable.delete(io)
+          selected[fiber] = selected.fetch(fiber, 0) | IO::WRITABLE
+        end
+      end
+      selected.each do |fiber, events|
+        fiber.resume(events) if fiber.alive?
+      end
+
+      if @waiting.any?
+        time = current_time
+        waiting, @waiting = @waiting, {}
+        waiting.each do |fiber, timeout|
+          next if !fiber.alive?
+          if timeout <= time
+            fiber.resume
+          else
+            @waiting[fiber] = timeout
+          end
+        end
+      end
+
+      if @ready.any?
+        ready = nil
+        @lock.synchronize { ready, @ready = @ready, [] }
+        ready.each { |fiber| fiber.resume if fiber.alive? }
+      end
+    end
+  end
+
+  def close
+    run
+    @urgent.each(&:close)
+  end
+
+  def io_wait(io, events, duration)
+    fiber = Fiber.current
+    @readable[io] = fiber if (events & IO::READABLE) != 0
+    @writable[io] = fiber if (events & IO::WRITABLE) != 0
+    @waiting[fiber] = current_time + duration if duration
+    Fiber.yield
+  ensure
+    @waiting.delete(fiber)
+    @readable.delete(io)
+    @writable.delete(io)
+  end
+
+  def kernel_sleep(duration = nil)
+    if duration
+      @waiting[Fiber.current] = current_time + duration
+      Fiber.yield
+    else
+      block(:sleep)
+    end
+    true
+  end
+
+  def block(blocker, timeout = nil)
+    fiber = Fiber.current
+    if timeout
+      @waiting[fiber] = current_time + timeout
+    else
+      @blocking[fiber] = true
+    end
+    Fiber.yield
+  ensure
+    @waiting.delete(fiber)
+    @blocking.delete(fiber)
+  end
+
+  def unblock(blocker, fiber)
+    @lock.synchronize { @ready << fiber }
+    @urgent.last.write_nonblock('.', exception: false)
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+end